@@ -0,0 +1,98 @@
+// CBOR Encoder
+// Concise Binary Object Representation (RFC 8949) for telemetry payloads
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: -
+// Target uC:       -
+// System Clock:    -
+
+// Hardware configuration:
+// -
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+// Items are written straight into the caller's buffer in the shortest form, so the
+// encoder needs no memory of its own. Maps are definite length, the caller
+// states the count first and then writes the items (key, value pairs for a map).
+
+#include <string.h>
+#include "cbor.h"
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+void initCborWriter(cborWriter *w, uint8_t data[], uint16_t size)
+{
+    w->data = data;
+    w->size = size;
+    w->length = 0;
+    w->overflow = false;
+}
+
+// Reserves size bytes, NULL once the buffer is full
+uint8_t* getCborSpace(cborWriter *w, uint16_t size)
+{
+    uint8_t *p;
+
+    if (w->overflow || size > w->size - w->length)
+    {
+        w->overflow = true;
+        return NULL;
+    }
+    p = &w->data[w->length];
+    w->length += size;
+    return p;
+}
+
+// Initial byte with the argument inline (0-23) or in the 1, 2 or 4 bytes after it
+void putCborHead(cborWriter *w, uint8_t majorType, uint32_t argument)
+{
+    uint8_t size = (argument < 24) ? 0 : (argument <= 0xFF) ? 1 : (argument <= 0xFFFF) ? 2 : 4;
+    uint8_t *p = getCborSpace(w, 1 + size);
+
+    if (p == NULL)
+    {
+        return;
+    }
+    *p++ = (majorType << 5) | ((size == 0) ? argument : (size == 1) ? 24 : (size == 2) ? 25 : 26);
+    while (size > 0)
+    {
+        size--;
+        *p++ = argument >> (size * 8);
+    }
+}
+
+void putCborUint(cborWriter *w, uint32_t value)
+{
+    putCborHead(w, CBOR_UINT, value);
+}
+
+void putCborText(cborWriter *w, char str[])
+{
+    uint16_t size = strlen(str);
+    uint8_t *p;
+
+    putCborHead(w, CBOR_TEXT, size);
+    p = getCborSpace(w, size);
+    if (p != NULL)
+    {
+        memcpy(p, str, size);
+    }
+}
+
+void putCborMap(cborWriter *w, uint16_t count)
+{
+    putCborHead(w, CBOR_MAP, count);
+}
+
+// Encoded size, 0 if the buffer was too small
+uint16_t getCborLength(cborWriter *w)
+{
+    return w->overflow ? 0 : w->length;
+}
@@ -0,0 +1,51 @@
+// CBOR Encoder
+// Concise Binary Object Representation (RFC 8949) for telemetry payloads
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: -
+// Target uC:       -
+// System Clock:    -
+
+// Hardware configuration:
+// -
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#ifndef CBOR_H_
+#define CBOR_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Major types
+#define CBOR_UINT   0
+#define CBOR_NINT   1
+#define CBOR_BYTES  2
+#define CBOR_TEXT   3
+#define CBOR_ARRAY  4
+#define CBOR_MAP    5
+
+typedef struct _cborWriter
+{
+    uint8_t *data;
+    uint16_t size;                  // Room in data
+    uint16_t length;                // Bytes written so far
+    bool overflow;                  // Something did not fit, nothing more is written
+} cborWriter;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+void initCborWriter(cborWriter *w, uint8_t data[], uint16_t size);
+void putCborUint(cborWriter *w, uint32_t value);
+void putCborText(cborWriter *w, char str[]);
+void putCborMap(cborWriter *w, uint16_t count);
+uint16_t getCborLength(cborWriter *w);
+
+#endif
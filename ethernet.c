@@ -58,6 +58,12 @@
 #include "dhcp.h"
 #include "mqtt.h"
 #include "plant.h"
+#include "perf.h"
+#include "store.h"
+#include "cbor.h"
+#include "json.h"
+#include "mqttsn.h"
+#include "policy.h"
 
 // Pins
 #define RED_LED PORTF,1
@@ -81,9 +87,29 @@
 #define HUM 3
 #define MOIST 4
 #define VOLUME 5
-
-// Plant Timer
-#define PLANT_AUTO_PUB_S 10
+#define SETPOINT 6
+
+// Auto publish formats
+#define PLANT_FORMAT_TEXT 0             // ASCII value per topic, through the store
+#define PLANT_FORMAT_CBOR 1             // One snapshot record per period
+#define PLANT_FORMAT_JSON 2
+
+// Auto publish policy defaults
+// A reading goes out when it moves past its deadband, at most every PLANT_MIN_PUB_S, and
+// every PLANT_HEARTBEAT_S even if it has not moved
+#define PLANT_MIN_PUB_S 10
+#define PLANT_HEARTBEAT_S 300
+
+// Plant alarms, published on their own lane as soon as they change
+#define ALARM_RESERVOIR 0               // Reservoir empty
+#define ALARM_DRY 1                     // Soil too dry
+#define ALARM_SENSOR 2                  // DHT22 not answering
+#define ALARM_COUNT 3
+#define ALARM_UNKNOWN 0xFF              // Not published yet, the retained state may be stale
+
+#define ALARM_RESERVOIR_LOW 20          // Volume below this raises the reservoir alarm
+#define ALARM_DRY_PCT 20                // Moisture below this raises the dry soil alarm
+#define ALARM_HYSTERESIS 5              // Cleared once this far above the threshold again
 
 // ----------------------------------------------------------------------------
 // Globals
@@ -93,16 +119,19 @@
 uint16_t lux = 0;
 uint8_t temp = 0, hum = 0;
 uint16_t moist = 0, volume = 0;
-uint8_t subbedTopicData = 0;
-bool timeToPublish = true;
+uint8_t moistureSetPoint = 45;          // From uta/plant/moisture_set_point
+publishPolicy plantPolicies[VOLUME + 1];     // Indexed by LUX..VOLUME
+uint8_t plantTopics[SETPOINT + 1];      // Registry handles, indexed by LUX..SETPOINT
+uint8_t plantSnapshotTopics[PLANT_FORMAT_JSON + 1];
+uint8_t plantFormat = PLANT_FORMAT_TEXT;
+uint16_t plantSnapshotSeq = 0;
+uint8_t alarmTopics[ALARM_COUNT];
+bool alarmRaised[ALARM_COUNT] = {false, false, false};
+uint8_t alarmReported[ALARM_COUNT] = {ALARM_UNKNOWN, ALARM_UNKNOWN, ALARM_UNKNOWN};     // Last state queued to the broker
 
 // MQTT
 bool mqttEnabled = false;
 bool mqttDisconnecting = false;
-bool mqttConnectSent = false;
-bool mqttSubAckNeeded = false;
-bool mqttSubbed = false;
-char subbedTopicDataStr[3] = {0, 0, NULL};
 bool autoPublishEnabled = false;
 
 //-----------------------------------------------------------------------------
@@ -226,6 +255,65 @@ void displayConnectionInfo()
         putsUart0("  Link is down\n");
 }
 
+void displayMqttBrokers()
+{
+    uint8_t i;
+    char str[80];
+    mqttBroker *broker;
+
+    for (i = 0; i < MQTT_MAX_BROKERS; i++)
+    {
+        broker = getMqttBroker(i);
+        if (broker != NULL)
+        {
+            snprintf(str, sizeof(str), "%c %"PRIu8".%"PRIu8".%"PRIu8".%"PRIu8":%"PRIu16" priority %"PRIu8", %"PRIu8" failures\n",
+                     (i == getMqttCurrentBroker()) ? '*' : ' ', broker->ip[0], broker->ip[1], broker->ip[2],
+                     broker->ip[3], broker->port, broker->priority, broker->failures);
+            putsUart0(str);
+        }
+    }
+}
+
+void displayPlantPolicies()
+{
+    uint8_t i;
+    uint16_t length;
+    char *name;
+    char str[96];
+    publishPolicy *p;
+
+    for (i = LUX; i <= VOLUME; i++)
+    {
+        p = &plantPolicies[i];
+        name = getMqttTopicName(plantTopics[i], &length);
+        snprintf(str, sizeof(str), "%.*s: deadband %"PRIu16"%s, min %"PRIu16" s, heartbeat %"PRIu16" s\n",
+                 length, name, p->deadband, (p->mode == POLICY_PERCENT) ? "%" : "", p->minInterval, p->heartbeat);
+        putsUart0(str);
+    }
+}
+
+void displayPerfCounters()
+{
+    uint8_t mode;
+    char str[80];
+    perfCounters *c;
+    uint32_t seconds;
+
+    putsUart0(isPerfEnabled() ? "Perf service on (echo 7, discard 9)\n" : "Perf service off\n");
+    for (mode = PERF_TCP; mode <= PERF_UDP; mode++)
+    {
+        c = getPerfCounters(mode);
+        seconds = getPerfElapsedSeconds(mode);
+        snprintf(str, sizeof(str), "  %s rx: %"PRIu32" B in %"PRIu32" seg, %"PRIu32" s, %"PRIu32" B/s\n",
+                 (mode == PERF_TCP) ? "TCP" : "UDP", c->rxBytes, c->rxSegments, seconds,
+                 (seconds > 0) ? c->rxBytes / seconds : 0);
+        putsUart0(str);
+        snprintf(str, sizeof(str), "      tx: %"PRIu32" B in %"PRIu32" seg, %"PRIu32" dropped\n",
+                 c->txBytes, c->txSegments, c->drops);
+        putsUart0(str);
+    }
+}
+
 void readConfiguration()
 {
     uint32_t temp;
@@ -313,24 +401,153 @@ char* convertIntToString(uint32_t num, char str[])
 
 int32_t convertStringToInt(char str[])
 {
-    int8_t len = 0, i = 0;
-    uint32_t num = 0, tens = 1;
-  
-    while (*str != NULL)
+    uint32_t num = 0;
+
+    while (*str >= '0' && *str <= '9')
     {
-        len++;
+        num = num * 10 + (*str - 48);
         str++;
     }
-  
-    str -= len;
-    tens = 10 * (len - 1);
-  
-    for (i = 0; i < len; i++)
+    return num;
+}
+
+// Decimal payload of a PUBLISH, -1 if empty or too long
+int32_t convertPayloadToInt(uint8_t data[], uint16_t size)
+{
+    char str[6];
+
+    if (size == 0 || size >= sizeof(str))
     {
-        num += (str[i] - 48) * tens;
-        tens = tens / 10;
+        return -1;
     }
-    return num;
+    memcpy(str, data, size);
+    str[size] = '\0';
+    return convertStringToInt(str);
+}
+
+// Latest reading for LUX..SETPOINT
+uint16_t getPlantValue(uint8_t id)
+{
+    switch (id)
+    {
+        case LUX:
+            return lux;
+        case TEMP:
+            return temp;
+        case HUM:
+            return hum;
+        case MOIST:
+            return moist;
+        case VOLUME:
+            return volume;
+        case SETPOINT:
+            return moistureSetPoint;
+    }
+    return 0;
+}
+
+// Plant topics are encoded once, published by handle
+void registerPlantTopics()
+{
+    uint8_t i;
+
+    plantTopics[LUX] = registerMqttTopic("uta/plant/lux", "lux");
+    plantTopics[TEMP] = registerMqttTopic("uta/plant/temp", "temp");
+    plantTopics[HUM] = registerMqttTopic("uta/plant/humidity", "humidity");
+    plantTopics[MOIST] = registerMqttTopic("uta/plant/moisture", "moisture");
+    plantTopics[VOLUME] = registerMqttTopic("uta/plant/reservoir", "reservoir");
+    plantTopics[SETPOINT] = registerMqttTopic("uta/plant/moisture_set_point", "setpoint");
+    plantSnapshotTopics[PLANT_FORMAT_CBOR] = registerMqttTopic("uta/plant/snapshot/cbor", "cbor");
+    plantSnapshotTopics[PLANT_FORMAT_JSON] = registerMqttTopic("uta/plant/snapshot/json", "json");
+    alarmTopics[ALARM_RESERVOIR] = registerMqttTopic("uta/plant/alarm/reservoir", "reservoir_alarm");
+    alarmTopics[ALARM_DRY] = registerMqttTopic("uta/plant/alarm/dry", "dry_alarm");
+    alarmTopics[ALARM_SENSOR] = registerMqttTopic("uta/plant/alarm/sensor", "sensor_alarm");
+
+    // Deadbands suit each sensor's noise, light varies over orders of magnitude
+    initPublishPolicy(&plantPolicies[LUX], POLICY_PERCENT, 10, PLANT_MIN_PUB_S, PLANT_HEARTBEAT_S);
+    initPublishPolicy(&plantPolicies[TEMP], POLICY_ABSOLUTE, 1, PLANT_MIN_PUB_S, PLANT_HEARTBEAT_S);
+    initPublishPolicy(&plantPolicies[HUM], POLICY_ABSOLUTE, 2, PLANT_MIN_PUB_S, PLANT_HEARTBEAT_S);
+    initPublishPolicy(&plantPolicies[MOIST], POLICY_ABSOLUTE, 2, PLANT_MIN_PUB_S, PLANT_HEARTBEAT_S);
+    initPublishPolicy(&plantPolicies[VOLUME], POLICY_ABSOLUTE, 5, PLANT_MIN_PUB_S, PLANT_HEARTBEAT_S);
+
+    // Readings can also go out over MQTT-SN, the gateway assigns their topic IDs
+    for (i = LUX; i <= SETPOINT; i++)
+    {
+        useMqttsnTopic(plantTopics[i]);
+    }
+}
+
+// Encodes every reading as one CBOR map, units are part of the keys
+// t_s is the uptime in seconds, seq lets the backend spot gaps
+// Returns the size, 0 if data is too small
+uint16_t putPlantSnapshotCbor(uint8_t data[], uint16_t size)
+{
+    cborWriter w;
+
+    initCborWriter(&w, data, size);
+    putCborMap(&w, 8);
+    putCborText(&w, "seq");
+    putCborUint(&w, plantSnapshotSeq);
+    putCborText(&w, "t_s");
+    putCborUint(&w, getUptime());
+    putCborText(&w, "lux");
+    putCborUint(&w, lux);
+    putCborText(&w, "temp_c");
+    putCborUint(&w, temp);
+    putCborText(&w, "hum_pct");
+    putCborUint(&w, hum);
+    putCborText(&w, "moist_pct");
+    putCborUint(&w, moist);
+    putCborText(&w, "vol_ml");
+    putCborUint(&w, volume);
+    putCborText(&w, "sp_pct");
+    putCborUint(&w, moistureSetPoint);
+    return getCborLength(&w);
+}
+
+// Same record as putPlantSnapshotCbor as a JSON object
+uint16_t putPlantSnapshotJson(char data[], uint16_t size)
+{
+    jsonWriter w;
+
+    initJsonWriter(&w, data, size);
+    startJsonObject(&w, NULL);
+    putJsonUint(&w, "seq", plantSnapshotSeq);
+    putJsonUint(&w, "t_s", getUptime());
+    putJsonUint(&w, "lux", lux);
+    putJsonUint(&w, "temp_c", temp);
+    putJsonUint(&w, "hum_pct", hum);
+    putJsonUint(&w, "moist_pct", moist);
+    putJsonUint(&w, "vol_ml", volume);
+    putJsonUint(&w, "sp_pct", moistureSetPoint);
+    endJsonObject(&w);
+    return getJsonLength(&w);
+}
+
+// Messages for filters subscribed from the shell are shown as they arrive
+void mqttShellMessage(char topic[], uint16_t topicLength, uint8_t data[], uint16_t dataLength, void *context)
+{
+    uint16_t i;
+
+    for (i = 0; i < topicLength; i++)
+    {
+        putcUart0(topic[i]);
+    }
+    putsUart0(": ");
+    for (i = 0; i < dataLength; i++)
+    {
+        putcUart0(data[i]);
+    }
+    putcUart0('\n');
+}
+
+// PUBACK for a publish from the shell
+void mqttPublishComplete(uint16_t packetId, void *context)
+{
+    char str[24];
+
+    snprintf(str, sizeof(str), "Published (id %"PRIu16")\n", packetId);
+    putsUart0(str);
 }
 
 void processShell(etherHeader *ether, socket *s)
@@ -343,7 +560,7 @@ void processShell(etherHeader *ether, socket *s)
         uint8_t i;
         uint8_t ip[IP_ADD_LENGTH];
         uint32_t* p32;
-        char *topic, *data;
+        char *topic;
 
         end = (c == 13) || (count == MAX_CHARS);
         if (!end)
@@ -391,10 +608,13 @@ void processShell(etherHeader *ether, socket *s)
                     {
                         putsUart0("MQTT already connected\n");
                     }
-                    else
+                    else if (startMqttConnection(s))
                     {
                         mqttEnabled = true;
-                        sendTcpArpRequest();
+                    }
+                    else
+                    {
+                        putsUart0("No MQTT broker\n");
                     }
                 }
                 if (strcmp(token, "disconnect") == 0)
@@ -402,8 +622,6 @@ void processShell(etherHeader *ether, socket *s)
                     if (mqttEnabled)
                     {
                         mqttEnabled = false;
-                        mqttConnectSent = false;
-                        mqttSubAckNeeded = false;
                         autoPublishEnabled = false;
                         disconnectMqtt(ether, s);
                     }
@@ -416,98 +634,288 @@ void processShell(etherHeader *ether, socket *s)
                 {
                     if (isMqttConAcked())
                     {
+                        uint8_t handle;
+                        char value[6];
+
                         topic = strtok(NULL, " ");
+                        handle = (topic != NULL) ? findMqttTopic(topic) : MQTT_TOPIC_INVALID;
 
-                        if ((strcmp(topic, "lux") == 0) || strcmp(topic, "uta/plant/lux") == 0)
-                        {
-                            convertIntToString(lux, data);
-                            topic = "uta/plant/lux";
-                        }
-                        else if ((strcmp(topic, "temp") == 0) || strcmp(topic, "uta/plant/temp") == 0)
-                        {
-                            convertIntToString(temp, data);
-                            topic = "uta/plant/temp";
-                        }
-                        else if ((strcmp(topic, "humidity") == 0) || strcmp(topic, "uta/plant/humidity") == 0)
+                        // Short name or full topic, found by handle
+                        for (i = LUX; i <= SETPOINT && plantTopics[i] != handle; i++);
+
+                        if (handle == MQTT_TOPIC_INVALID || i > SETPOINT)
                         {
-                            convertIntToString(hum, data);
-                            topic = "uta/plant/humidity";
+                            putsUart0("Invalid topic\n");
                         }
-                        else if ((strcmp(topic, "moisture") == 0) || strcmp(topic, "uta/plant/moisture") == 0)
+                        else if (publishMqttQos1(ether, s, handle, convertIntToString(getPlantValue(i), value),
+                                                 mqttPublishComplete, NULL) == 0)
                         {
-                            convertIntToString(moist, data);
-                            topic = "uta/plant/moisture";
+                            putsUart0("Publish window full\n");
                         }
-                        else if ((strcmp(topic, "reservoir") == 0) || strcmp(topic, "uta/plant/reservoir") == 0)
+                    }
+                    else
+                    {
+                        putsUart0("MQTT not connected yet\n");
+                    }
+                }
+                if (strcmp(token, "subscribe") == 0)
+                {
+                    topic = strtok(NULL, " ");
+                    if (topic != NULL && subscribeMqtt(topic, mqttShellMessage, NULL) == MQTT_SUBSCRIPTION_INVALID)
+                    {
+                        putsUart0("Invalid filter or too many subscriptions\n");
+                    }
+                }
+                if (strcmp(token, "unsubscribe") == 0)
+                {
+                    topic = strtok(NULL, " ");
+                    if (topic != NULL && !unsubscribeMqtt(topic))
+                    {
+                        putsUart0("Not subscribed\n");
+                    }
+                }
+                if (strcmp(token, "session") == 0)
+                {
+                    char *arg = strtok(NULL, " ");
+
+                    // Used from the next connect
+                    if (arg != NULL && strcmp(arg, "clean") == 0)
+                    {
+                        setMqttCleanSession(true);
+                    }
+                    else if (arg != NULL && strcmp(arg, "keep") == 0)
+                    {
+                        setMqttCleanSession(false);
+                    }
+                    else
+                    {
+                        putsUart0(isMqttSessionPresent() ? "Session resumed\n" : "New session\n");
+                    }
+                }
+                if (strcmp(token, "broker") == 0)
+                {
+                    char *action = strtok(NULL, " ");
+                    char *arg;
+                    uint16_t port = MQTT_PORT;
+                    uint8_t priority = 0;
+
+                    // Tried by priority, lowest first
+                    if (action != NULL && strcmp(action, "add") == 0)
+                    {
+                        for (i = 0; i < IP_ADD_LENGTH; i++)
                         {
-                            convertIntToString(volume, data);
-                            topic = "uta/plant/reservoir";
+                            arg = strtok(NULL, " .");
+                            ip[i] = (arg != NULL) ? asciiToUint8(arg) : 0;
                         }
-                        else if ((strcmp(topic, "setpoint") == 0) || strcmp(topic, "uta/plant/moisture_set_point") == 0)
+                        arg = strtok(NULL, " ");
+                        if (arg != NULL)
                         {
-                            data[0] = '4';
-                            data[1] = '5';
-                            data[2] = NULL;
-                            topic = "uta/plant/moisture_set_point";
+                            port = convertStringToInt(arg);
+                            arg = strtok(NULL, " ");
                         }
-                        else
+                        if (arg != NULL)
                         {
-                            topic = NULL;
-                            data = NULL;
-                            putsUart0("Invalid topic\n");
+                            priority = convertStringToInt(arg);
                         }
-
-                        if (topic != NULL && data != NULL)
+                        if (addMqttBroker(ip, port, priority) == MQTT_BROKER_INVALID)
                         {
-                            publishMqtt(ether, s, topic, data);
+                            putsUart0("Too many brokers\n");
                         }
                     }
+                    else if (action != NULL && strcmp(action, "clear") == 0)
+                    {
+                        clearMqttBrokers();
+                    }
                     else
                     {
-                        putsUart0("MQTT not connected yet\n");
+                        displayMqttBrokers();
                     }
                 }
-                if (strcmp(token, "subscribe") == 0)
+                if (strcmp(token, "version") == 0)
                 {
-                    topic = strtok(NULL, " ");
-                    if (topic != NULL)
-                    {
-                        char *topicPtr = topic;
-                        uint16_t topicLen = 0;
+                    char *arg = strtok(NULL, " ");
+                    char str[10];
 
-                        while (*topicPtr != NULL)
-                        {
-                            topicPtr++;
-                            topicLen++;
-                        }
+                    // Used from the next connect
+                    if (arg != NULL && strcmp(arg, "3") == 0)
+                    {
+                        setMqttVersion(MQTT_VERSION_311);
+                    }
+                    else if (arg != NULL && strcmp(arg, "5") == 0)
+                    {
+                        setMqttVersion(MQTT_VERSION_5);
+                    }
+                    else
+                    {
+                        putsUart0((getMqttVersion() == MQTT_VERSION_5) ? "MQTT 5.0" : "MQTT 3.1.1");
+                        putsUart0(", last reason code ");
+                        putsUart0(convertIntToString(getMqttReasonCode(), str));
+                        putsUart0("\n");
+                    }
+                }
+            }
+            if (strcmp(token, "mqttsn") == 0)
+            {
+                char *action = strtok(NULL, " ");
+                char *arg;
 
-                        setSubbedTopicLengh(topicLen);
-                        mqttSubAckNeeded = true;
-                        subscribeMqtt(ether, s, topic);
-                        // uint8_t k = 0;
+                if (action != NULL && strcmp(action, "connect") == 0)
+                {
+                    for (i = 0; i < IP_ADD_LENGTH; i++)
+                    {
+                        arg = strtok(NULL, " .");
+                        ip[i] = (arg != NULL) ? asciiToUint8(arg) : 0;
                     }
+                    arg = strtok(NULL, " ");
+                    connectMqttsn(ip, (arg != NULL) ? convertStringToInt(arg) : MQTTSN_PORT);
                 }
-                if (strcmp(token, "unsubscribe") == 0)
+                else if (action != NULL && strcmp(action, "disconnect") == 0)
+                {
+                    disconnectMqttsn(ether);
+                }
+                else if (action != NULL && strcmp(action, "publish") == 0)
                 {
+                    uint8_t handle;
+                    char value[6];
+                    int8_t qos = 1;
+
                     topic = strtok(NULL, " ");
-                    if (topic != NULL)
+                    handle = (topic != NULL) ? findMqttTopic(topic) : MQTT_TOPIC_INVALID;
+                    for (i = LUX; i <= SETPOINT && plantTopics[i] != handle; i++);
+                    arg = strtok(NULL, " ");
+                    if (arg != NULL)
+                    {
+                        qos = (arg[0] == '-') ? -1 : convertStringToInt(arg);
+                    }
+
+                    if (handle == MQTT_TOPIC_INVALID || i > SETPOINT)
                     {
-                        mqttSubAckNeeded = false;
-                        unsubscribeMqtt(ether, s, topic);
-                        // uint8_t placeholder = 0;
+                        putsUart0("Invalid topic\n");
                     }
+                    else if (!publishMqttsn(ether, handle, (uint8_t*)convertIntToString(getPlantValue(i), value),
+                                            strlen(value), qos, mqttPublishComplete, NULL))
+                    {
+                        putsUart0("MQTT-SN not ready\n");
+                    }
+                }
+                else
+                {
+                    putsUart0("MQTT-SN state ");
+                    putcUart0('0' + getMqttsnState());
+                    putcUart0('\n');
                 }
             }
             if (strcmp(token, "ip") == 0)
             {
                 displayConnectionInfo();
             }
+            if (strcmp(token, "store") == 0)
+            {
+                char *arg = strtok(NULL, " ");
+
+                if (arg != NULL && strcmp(arg, "rate") == 0)
+                {
+                    arg = strtok(NULL, " ");
+                    if (arg != NULL)
+                    {
+                        setStoreDrainRate(asciiToUint8(arg));
+                    }
+                }
+                else
+                {
+                    char str[64];
+                    snprintf(str, sizeof(str), "Stored: %"PRIu16" (%"PRIu16" in EEPROM), dropped: %"PRIu32"\n",
+                             getStoreCount(), getStoreSpilledCount(), getStoreDropCount());
+                    putsUart0(str);
+                    snprintf(str, sizeof(str), "Drain rate: %"PRIu8"/s\n", getStoreDrainRate());
+                    putsUart0(str);
+                }
+            }
+            if (strcmp(token, "perf") == 0)
+            {
+                char *arg = strtok(NULL, " ");
+
+                if (arg == NULL)
+                {
+                    displayPerfCounters();
+                }
+                else if (strcmp(arg, "on") == 0)
+                {
+                    enablePerf();
+                }
+                else if (strcmp(arg, "off") == 0)
+                {
+                    disablePerf();
+                }
+                else if (strcmp(arg, "reset") == 0)
+                {
+                    resetPerfCounters();
+                }
+            }
             if (strcmp(token, "autopub") == 0)
             {
-                if (isMqttConAcked())
+                char *format = strtok(NULL, " ");
+
+                if (format != NULL && strcmp(format, "policy") == 0)
+                {
+                    char *name = strtok(NULL, " ");
+                    char *mode = strtok(NULL, " ");
+                    char *arg[3];
+                    uint8_t handle = (name != NULL) ? findMqttTopic(name) : MQTT_TOPIC_INVALID;
+                    uint8_t id = 0;
+
+                    for (i = 0; i < 3; i++)
+                    {
+                        arg[i] = strtok(NULL, " ");
+                    }
+                    for (i = LUX; i <= VOLUME; i++)
+                    {
+                        if (handle != MQTT_TOPIC_INVALID && plantTopics[i] == handle)
+                        {
+                            id = i;
+                        }
+                    }
+
+                    if (name == NULL)
+                    {
+                        displayPlantPolicies();
+                    }
+                    else if (id == 0 || mode == NULL || arg[2] == NULL
+                             || (strcmp(mode, "abs") != 0 && strcmp(mode, "pct") != 0))
+                    {
+                        putsUart0("Usage: autopub policy NAME abs|pct DEADBAND MIN MAX\n");
+                    }
+                    else
+                    {
+                        initPublishPolicy(&plantPolicies[id], (strcmp(mode, "pct") == 0) ? POLICY_PERCENT : POLICY_ABSOLUTE,
+                                          convertStringToInt(arg[0]), convertStringToInt(arg[1]),
+                                          convertStringToInt(arg[2]));
+                    }
+                }
+                else if (format != NULL && strcmp(format, "cbor") == 0)
+                {
+                    plantFormat = PLANT_FORMAT_CBOR;
+                    putsUart0("Auto publish as CBOR snapshots\n");
+                }
+                else if (format != NULL && strcmp(format, "json") == 0)
+                {
+                    plantFormat = PLANT_FORMAT_JSON;
+                    putsUart0("Auto publish as JSON snapshots\n");
+                }
+                else if (format != NULL && strcmp(format, "text") == 0)
+                {
+                    plantFormat = PLANT_FORMAT_TEXT;
+                    putsUart0("Auto publish as text per topic\n");
+                }
+                else if (isMqttConAcked())
                 {
                     if (!autoPublishEnabled)
                     {
+                        // Every reading goes out once when enabled
+                        for (i = LUX; i <= VOLUME; i++)
+                        {
+                            resetPublishPolicy(&plantPolicies[i]);
+                        }
                         autoPublishEnabled = true;
                         putsUart0("Auto publish enabled\n");
                     }
@@ -612,9 +1020,15 @@ void processShell(etherHeader *ether, socket *s)
                 putsUart0("  dhcp on|off|renew|release\n");
                 putsUart0("  mqtt ACTION [USER [PASSWORD]]\n");
                 putsUart0("    where ACTION = {connect|disconnect|publish TOPIC DATA\n");
-                putsUart0("                   |subscribe TOPIC|unsubscribe TOPIC}\n");
-                putsUart0("  autopub\n");
+                putsUart0("                   |subscribe FILTER|unsubscribe FILTER\n");
+                putsUart0("                   |session [clean|keep]|version [3|5]\n");
+                putsUart0("                   |broker [add w.x.y.z [PORT [PRIORITY]]|clear]}\n");
+                putsUart0("  mqttsn [connect w.x.y.z [PORT]|disconnect|publish TOPIC [-1|0|1]]\n");
+                putsUart0("  autopub [text|cbor|json]\n");
+                putsUart0("  autopub policy [NAME abs|pct DEADBAND MIN MAX]\n");
                 putsUart0("  ip\n");
+                putsUart0("  perf [on|off|reset]\n");
+                putsUart0("  store [rate N]\n");
                 putsUart0("  ping w.x.y.z\n");
                 putsUart0("  reboot\n");
                 putsUart0("  set ip|gw|dns|time|mqtt|sn w.x.y.z\n");
@@ -623,56 +1037,205 @@ void processShell(etherHeader *ether, socket *s)
     }
 }
 
-void callbackPublishPlantData()
+// Samples go through the store-and-forward queue so nothing is lost while the
+// broker is unreachable, drainStore sends them once connected
+// Each reading is stored when its publish policy says so, see policy.c
+// In CBOR and JSON mode a snapshot of every reading is one QoS 1 PUBLISH instead, sent when
+// any reading is due, encoded straight into the outbound frame and held in the in-flight window
+void autoPublishPlantData(etherHeader *ether, socket *s)
 {
-    timeToPublish = true;
-    KillTimer(callbackPublishPlantData);
+    uint8_t i;
+    uint8_t topic = plantSnapshotTopics[plantFormat];
+    uint8_t *payload;
+    uint16_t maxSize, size = 0;
+    bool due = false;
+
+    if (plantFormat != PLANT_FORMAT_TEXT)
+    {
+        for (i = LUX; i <= VOLUME; i++)
+        {
+            due |= isPublishDue(&plantPolicies[i], getPlantValue(i));
+        }
+        if (!due)
+        {
+            return;
+        }
+
+        // Tried again on the next pass if the window is full
+        payload = reserveMqttPublishQos1(ether, s, topic, &maxSize);
+        if (payload != NULL && plantFormat == PLANT_FORMAT_CBOR)
+        {
+            size = putPlantSnapshotCbor(payload, maxSize);
+        }
+        if (payload != NULL && plantFormat == PLANT_FORMAT_JSON)
+        {
+            size = putPlantSnapshotJson((char*)payload, maxSize);
+        }
+        if (size > 0 && commitMqttPublishQos1(ether, s, topic, size, NULL, NULL) != 0)
+        {
+            plantSnapshotSeq++;
+            for (i = LUX; i <= VOLUME; i++)
+            {
+                setPublished(&plantPolicies[i], getPlantValue(i));
+            }
+        }
+    }
+    else
+    {
+        for (i = LUX; i <= VOLUME; i++)
+        {
+            if (isPublishDue(&plantPolicies[i], getPlantValue(i)))
+            {
+                storeTelemetry(plantTopics[i], getPlantValue(i));
+                setPublished(&plantPolicies[i], getPlantValue(i));
+            }
+        }
+    }
 }
 
-void autoPublishPlantData(etherHeader *data, socket *s)
+// Raised below low, cleared once ALARM_HYSTERESIS above it so a reading near the
+// threshold does not flood the broker
+void updatePlantAlarm(uint8_t alarm, uint16_t value, uint16_t low)
 {
-    static uint8_t plant_state = LUX;
+    if (value < low)
+    {
+        alarmRaised[alarm] = true;
+    }
+    else if (value >= low + ALARM_HYSTERESIS)
+    {
+        alarmRaised[alarm] = false;
+    }
+}
 
-    if (timeToPublish)
+// Publishes each alarm that changed since it was last queued, "1" raised and "0" cleared
+// Runs every pass of the main loop, so an alarm goes out with the next sensor reading
+// instead of waiting for the auto publish period or the stored telemetry
+void checkPlantAlarms(etherHeader *ether, socket *s)
+{
+    uint8_t i;
+
+    updatePlantAlarm(ALARM_RESERVOIR, volume, ALARM_RESERVOIR_LOW);
+    updatePlantAlarm(ALARM_DRY, moist, ALARM_DRY_PCT);
+    alarmRaised[ALARM_SENSOR] = isDHT22Failed();
+
+    // Tried again on the next pass if the window is full
+    for (i = 0; i < ALARM_COUNT; i++)
     {
-        char buf[4] = {0, 0, 0, 0};
-        switch (plant_state)
+        if (alarmReported[i] != alarmRaised[i]
+            && publishMqttAlarm(ether, s, alarmTopics[i], alarmRaised[i] ? "1" : "0", NULL, NULL) != 0)
         {
-            case LUX:
-                // snprintf(strInput, sizeof(strInput), "Lux: %"PRIu16" lx\n", volume);
-                // putsUart0(strInput);
-                publishMqtt(data, s, "uta/plant/lux", convertIntToString(lux, buf));
-                plant_state = TEMP;
-                break;
-            case TEMP:
-                snprintf(strInput, sizeof(strInput), "Temp: %"PRIu8" C\n", temp);
-                // putsUart0(strInput);
-                publishMqtt(data, s, "uta/plant/temp", convertIntToString(temp, buf));
-                plant_state = HUM;
-                break;
-            case HUM:
-                // snprintf(strInput, sizeof(strInput), "Hum: %"PRIu8" C\n", temp);
-                // putsUart0(strInput);
-                publishMqtt(data, s, "uta/plant/humidity", convertIntToString(hum, buf));
-                plant_state = MOIST;
-                break;
-            case MOIST:
-                // snprintf(strInput, sizeof(strInput), "Moisture: %"PRIu16"%%\n", moist);
-                // putsUart0(strInput);
-                publishMqtt(data, s, "uta/plant/moisture", convertIntToString(moist, buf));
-                plant_state = VOLUME;
-                break;
-            case VOLUME:
-                // snprintf(strInput, sizeof(strInput), "Volume: %"PRIu16" mL\n", volume);
-                // putsUart0(strInput);
-                publishMqtt(data, s, "uta/plant/reservoir", convertIntToString(volume, buf));
-                plant_state = LUX;
-                break;
+            alarmReported[i] = alarmRaised[i];
         }
+    }
+}
+
+// Publishes one stored sample at QoS 1, so it only leaves the queue once it is in the
+// in-flight window
+// Anything that stops the publish keeps the record at the head of the store for the next try
+bool sendStoredPlantData(etherHeader *ether, socket *s, uint8_t topic, uint16_t value)
+{
+    char buf[6];
 
-        timeToPublish = false;
-        startOneshotTimer(callbackPublishPlantData, PLANT_AUTO_PUB_S);
+    // Only a record for a topic that no longer exists is dropped
+    if (getMqttTopicName(topic, NULL) == NULL)
+    {
+        return true;
     }
+    return publishMqttQos1(ether, s, topic, convertIntToString(value, buf), NULL, NULL) != 0;
+}
+
+// Broker connection events
+
+// Sends MQTT Connect message once TCP is up
+void mqttSocketConnected(etherHeader *ether, socket *s)
+{
+    if (mqttEnabled)
+    {
+        connectMqtt(ether, s);
+    }
+}
+
+void mqttSocketReceived(etherHeader *ether, socket *s, uint8_t data[], uint16_t size)
+{
+    // CONNACK, SUBACK and PUBLISH are picked out of the byte stream, PUBLISHes go to the
+    // handler of each matching subscription
+    processMqttData(ether, s, data, size);
+
+    // MQTT Disconnect Fin handler
+    if (mqttDisconnecting)
+    {
+        if (!isTcpFin(ether))
+        {
+            sendTcpFin(s);
+        }
+        mqttDisconnecting = false;
+    }
+}
+
+// uta/plant/moisture_set_point, percent
+void mqttSetPointReceived(char topic[], uint16_t topicLength, uint8_t data[], uint16_t dataLength, void *context)
+{
+    int32_t value = convertPayloadToInt(data, dataLength);
+
+    if (value >= 0 && value <= 100)
+    {
+        moistureSetPoint = value;
+    }
+}
+
+// uta/plant/schedule/+, "publish" sets the auto publish heartbeat in seconds
+void mqttScheduleReceived(char topic[], uint16_t topicLength, uint8_t data[], uint16_t dataLength, void *context)
+{
+    int32_t value = convertPayloadToInt(data, dataLength);
+    uint8_t i;
+
+    if (topicLength >= 8 && memcmp(&topic[topicLength - 8], "/publish", 8) == 0 && value > 0 && value <= 0xFFFF)
+    {
+        for (i = LUX; i <= VOLUME; i++)
+        {
+            plantPolicies[i].heartbeat = value;
+        }
+    }
+}
+
+// uta/plant/command/#, "pump" sets the pump duty cycle (0-1024)
+void mqttCommandReceived(char topic[], uint16_t topicLength, uint8_t data[], uint16_t dataLength, void *context)
+{
+    int32_t value = convertPayloadToInt(data, dataLength);
+
+    if (topicLength >= 5 && memcmp(&topic[topicLength - 5], "/pump", 5) == 0 && value >= 0 && value <= 1024)
+    {
+        setWaterPumpSpeed(value);
+    }
+}
+
+// Broker went away or could not be reached, tries again until "mqtt disconnect"
+// Auto publish keeps sampling into the store until the broker is back
+void mqttSocketClosed(socket *s)
+{
+    resetMqtt();
+    if (mqttEnabled)
+    {
+        scheduleMqttReconnect();
+    }
+}
+
+const socketCallbacks mqttSocketCallbacks =
+{
+    mqttSocketConnected,
+    mqttSocketReceived,
+    NULL,
+    mqttSocketClosed
+};
+
+// Every module's 1 second tick shares one timer slot, runs in the timer ISR
+void callbackSecondTimer(void)
+{
+    callbackTcpTimer();
+    callbackPerfTimer();
+    callbackStoreTimer();
+    mqttTick();
+    mqttsnTick();
 }
 
 //-----------------------------------------------------------------------------
@@ -688,7 +1251,10 @@ int main(void)
     uint8_t* udpData;
     uint8_t buffer[MAX_PACKET_SIZE];
     etherHeader *data = (etherHeader*) buffer;
-    socket s;
+    socket *s;
+    socket *tcpSocket;
+    socket replySocket;
+    uint8_t mac[6];
 
     // Clears buffer from last reboot
     uint16_t i = 0;
@@ -709,6 +1275,11 @@ int main(void)
 
     // Init sockets
     initSockets();
+    initPerf();
+    initStore(sendStoredPlantData);
+    initMqttsn();
+    startPeriodicTimer(callbackSecondTimer, 1);
+    registerPlantTopics();
 
     // Init ethernet interface (eth0)
     putsUart0("\nStarting eth0\n");
@@ -728,6 +1299,11 @@ int main(void)
     // Init plant
     initPlant(); /**************** Comment this out, otherwise i2c errors */
 
+    // Seed random numbers (ports, ISNs) from the MAC and load cell noise
+    getEtherMacAddress(mac);
+    seedRandom32((mac[2] << 24) | (mac[3] << 16) | (mac[4] << 8) | mac[5]);
+    seedRandom32(getHX711Raw());
+
     disableDhcp();
 
     // TODO: Remove manual IP stuff once EEPROM is fixed
@@ -735,6 +1311,7 @@ int main(void)
     uint8_t tempLocalIpAddress[4];
     uint8_t tempSn[4];
     uint8_t tempGw[4];
+    uint8_t brokerIp[4];
 
     tempLocalIpAddress[0] = 192;
     tempLocalIpAddress[1] = 168;
@@ -760,23 +1337,32 @@ int main(void)
 
     // Socket info
     // TODO: Write function that does all of the socket stuff
+    s = newSocket();
 
-    // IP
-    s.remoteIpAddress[0] = tempGw[0];
-    s.remoteIpAddress[1] = tempGw[1];
-    s.remoteIpAddress[2] = tempGw[2];
-    s.remoteIpAddress[3] = tempGw[3];
-
-    // Ports
-    s.remotePort = 1883; // Unencrypted MQTT Port
-    s.localPort = 50143; // Gets random port, start at 50000 for testing
+    // IP and port come from the broker list on each connect, the configured broker or
+    // else the gateway. More can be added with "mqtt broker add".
+    getIpMqttBrokerAddress(brokerIp);
+    if ((brokerIp[0] | brokerIp[1] | brokerIp[2] | brokerIp[3]) == 0)
+    {
+        memcpy(brokerIp, tempGw, IP_ADD_LENGTH);
+    }
+    addMqttBroker(brokerIp, MQTT_PORT, 0); // Unencrypted MQTT Port
+    // Local port and ISN are picked at random for each connection
 
     // SEQ/ACK Nums
-    s.sequenceNumber = htonl(2); // Starts at 1
-    s.acknowledgementNumber = htonl(0); // Will be set by the server
+    s->acknowledgementNumber = htonl(0); // Will be set by the server
+
+    // Segment size, updated from the MSS option in the SYN-ACK
+    s->mss = TCP_DEFAULT_MSS;
 
     // State
-    s.state = TCP_CLOSED; // Closed on startup
+    s->state = TCP_CLOSED; // Closed on startup
+
+    // MQTT runs from the connection events
+    setSocketCallbacks(s, &mqttSocketCallbacks, NULL);
+    subscribeMqtt("uta/plant/moisture_set_point", mqttSetPointReceived, NULL);
+    subscribeMqtt("uta/plant/schedule/+", mqttScheduleReceived, NULL);
+    subscribeMqtt("uta/plant/command/#", mqttCommandReceived, NULL);
 
     setWaterPumpSpeed(850);
 
@@ -785,9 +1371,12 @@ int main(void)
     // but the goal here is simplicity
     while (true)
     {
-        // Get plant data 4 seconds
+        // Get plant data 4 seconds, soil moisture every second
         getPlantData(&lux, &temp, &hum, &moist, &volume);
 
+        // Alarms go out ahead of the periodic data
+        checkPlantAlarms(data, s);
+
         // Moisture Setpoint Pseudocode
         // if (moisture > moisture_set_point & notpumping)
         // {
@@ -797,11 +1386,11 @@ int main(void)
         // Auto publishes plant data
         if (autoPublishEnabled)
         {
-            autoPublishPlantData(data, &s);
+            autoPublishPlantData(data, s);
         }
 
         // Put terminal processing here
-        processShell(data, &s);
+        processShell(data, s);
         
         /*
         // DHCP maintenance
@@ -812,14 +1401,16 @@ int main(void)
         */
 
         // TCP pending messages
-        sendTcpPendingMessages(data, &s);
+        sendTcpPendingMessages(data);
 
-        // Sends MQTT Connect message if not sent
-        if (!mqttConnectSent && (getTcpState(0) == TCP_ESTABLISHED) && mqttEnabled)
-        {
-            connectMqtt(data, &s);
-            mqttConnectSent = true;
-        }
+        // Reconnects, keepalive and QoS 1 messages waiting for a connection
+        sendMqttPendingMessages(data, s);
+
+        // Telemetry stored while offline
+        drainStore(data, s);
+
+        // MQTT-SN ARP, CONNECT, REGISTER, retries and keepalive
+        sendMqttsnPendingMessages(data);
 
         // Packet processings
         if (isEtherDataAvailable())
@@ -834,15 +1425,18 @@ int main(void)
             }
 
             // Get packet
-            getEtherPacket(data, MAX_PACKET_SIZE);
+            // Arrival times are a cheap source of entropy
+            seedRandom32(getEtherPacket(data, MAX_PACKET_SIZE));
 
             // Route ARP response to appropriate handlers
             // DHCP uses ARP response to verify address granted is not in use
             // TCP active open uses ARP response to get the HW address to establish the socket
+            // MQTT-SN resolves its gateway the same way
             if (isArpResponse(data))
             {
                 // processDhcpArpResponse(data);
-                processTcpArpResponse(data, &s);
+                processTcpArpResponse(data, s);
+                processMqttsnArpResponse(data);
             }
 
             // Handle ARP request
@@ -851,7 +1445,7 @@ int main(void)
                 sendArpResponse(data);
             }
 
-            if (getTcpState(0) == TCP_CLOSED)
+            if (getTcpState(s) == TCP_CLOSED)
             {
                 waitMicrosecond(1000);
             }
@@ -868,7 +1462,15 @@ int main(void)
                     }
 
                     // Handle UDP datagram
-                    if (isUdp(data))
+                    if (isUdp(data) && isPerfUdp(data))
+                    {
+                        processPerfUdp(data);
+                    }
+                    else if (isUdp(data) && isMqttsn(data))
+                    {
+                        processMqttsn(data);
+                    }
+                    else if (isUdp(data))
                     {
                         udpData = getUdpData(data);
                         if (strcmp((char*)udpData, "on") == 0)
@@ -879,67 +1481,25 @@ int main(void)
                         {
                             setPinValue(GREEN_LED, 0);
                         }
-                        getSocketInfoFromUdpPacket(data, &s);
-                        sendUdpMessage(data, s, (uint8_t*)"Received", 9);
+                        getSocketInfoFromUdpPacket(data, &replySocket);
+                        sendUdpMessage(data, replySocket, (uint8_t*)"Received", 9);
                     }
 
                     // Handle TCP datagram
                     if (isTcp(data))
                     {
-                        processTcpResponse(data, &s);
-                        /*
-                        if (isTcpPortOpen(data))
-                        {
-
-                           // isSYN_ACK(data);
-                           processTcpResponse(data);
-                            // processTcpResponse
-                        }
-                        else
+                        tcpSocket = findTcpSocket(data);
+                        if (tcpSocket != NULL)
                         {
-                            sendTcpResponse(data, &s, ACK | RST);
+                            processTcpResponse(data, tcpSocket);
                         }
-                        */
-
-                        // MQTT Connect Ack handler
-                        if (mqttConnectSent && !isMqttConAcked())
+                        else if (isTcpPortOpen(data))
                         {
-                            checkMqttConAck(data, &s);
+                            processTcpListenResponse(data);
                         }
-
-                        // MQTT Subscribe Ack handler
-                        if (mqttSubAckNeeded && !isMqttSubAcked())
-                        {
-                            checkMqttSubAck(data, &s);
-                            if (isMqttSubAcked())
-                            {
-                                mqttSubAckNeeded = false;
-                                mqttSubbed = true;
-                            }
-                        }
-
-                        if (mqttSubbed)
-                        {
-                            if (processPubMessage(data, &s, subbedTopicDataStr))
-                            {
-                                subbedTopicData = convertStringToInt(subbedTopicDataStr);
-                            }
-                        }
-
-//                        if(isMqttConAcked() == true)
-//                        {
-//                            //subscribe
-//                            //subscribeMqtt(data, &s,"uta/plant_lux");
-//                            subscribeMqtt(data, &s,"uta/weather/wind_direction");
-//                        }
-                        // MQTT Disconnect Fin handler
-                        if (mqttDisconnecting)
+                        else
                         {
-                            if (!isTcpFin(data))
-                            {
-                                sendTcpFin();
-                            }
-                            mqttDisconnecting = false;
+                            sendTcpResponse(data, &replySocket, ACK | RST);
                         }
                     }
                 }
@@ -0,0 +1,828 @@
+// MQTT Load Harness
+// Runs the MQTT and TCP code on a Linux host against an in-process mock broker
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: Linux host
+// Target uC:       -
+// System Clock:    -
+
+// Hardware configuration:
+// -
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+// Build and run from the repository root:
+//   gcc -std=gnu99 -O2 -I. -o mqttload host/mqttload.c mqtt.c tcp.c socket.c ip.c udp.c arp.c
+//   ./mqttload [MESSAGES [PAYLOAD [PUBLISHERS]]]
+//
+// The firmware's mqtt.c, tcp.c, socket.c, ip.c and arp.c are linked unchanged. Only the
+// hardware is replaced: frames the stack puts on the wire go to a mock broker in this
+// file, frames the broker sends are handed back the way the main loop does, and the
+// 1 s timer ticks from the host clock. The wire itself costs nothing, so the numbers
+// measure the protocol code: compare them before and after a change on the same host.
+//
+// Three runs are made:
+//   publish qos0  MESSAGES PUBLISHes from the board, timed until the broker parses them
+//   publish qos1  the same at QoS 1, timed until the PUBACK completes them on the board
+//   fan-in        MESSAGES PUBLISHes from PUBLISHERS topics to one wildcard subscription,
+//                 timed from the broker until the board's message callback
+// Each reports messages/s, wire bytes/s and latency percentiles in microseconds.
+// Payloads start with the message number in ASCII, padded to PAYLOAD bytes.
+
+#ifdef __linux__                    // Host only, empty when built for the board
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "arp.h"
+#include "ip.h"
+#include "tcp.h"
+#include "socket.h"
+#include "mqtt.h"
+#include "timer.h"
+
+#define LOAD_MESSAGES 100000
+#define LOAD_PAYLOAD 32
+#define LOAD_PUBLISHERS 16
+#define LOAD_TIMEOUT_S 30           // Gives up on a run after this long
+
+#define WIRE_FRAMES 256             // Frames in flight each way
+#define FRAME_SIZE 1518
+#define BROKER_PORT MQTT_PORT
+#define BROKER_MSS 1460
+#define BROKER_WINDOW 65535
+#define BROKER_STREAM_SIZE 65536    // Board to broker bytes not yet parsed
+
+#define TIMER_SLOTS 10
+
+// Frames waiting on the wire, one ring per direction
+typedef struct _wire
+{
+    uint8_t frames[WIRE_FRAMES][FRAME_SIZE];
+    uint16_t sizes[WIRE_FRAMES];
+    uint16_t head;
+    uint16_t count;
+    uint32_t bytes;                 // Ever queued, for bytes/s
+    uint32_t drops;
+} wire;
+
+// Broker side of the one TCP connection, lossless and in order
+typedef struct _mockBroker
+{
+    bool connected;
+    uint32_t sequenceNumber;        // Next byte the broker sends
+    uint32_t acknowledgementNumber; // Next byte expected from the board
+    uint32_t boardAcked;            // Highest sequence number the board acknowledged
+    uint16_t boardWindow;
+    uint16_t boardPort;
+    uint8_t boardHwAddress[6];
+    uint8_t stream[BROKER_STREAM_SIZE];
+    uint32_t streamSize;
+    uint8_t reply[BROKER_MSS];      // Control packets to send back
+    uint16_t replySize;
+    uint32_t publishes;             // PUBLISHes parsed
+} mockBroker;
+
+typedef struct _loadRun
+{
+    const char *name;
+    uint32_t messages;
+    uint32_t completed;
+    uint64_t *sentAt;               // Nanoseconds, by message number
+    uint32_t *latency;              // Nanoseconds, in completion order
+    uint64_t start;
+    uint64_t end;
+    uint32_t wireBytes;
+} loadRun;
+
+// ------------------------------------------------------------------------------
+//  Globals
+// ------------------------------------------------------------------------------
+
+uint8_t boardMac[6] = {2, 3, 4, 5, 6, 0x79};
+uint8_t brokerMac[6] = {2, 0, 0, 0, 0, 1};
+uint8_t boardIp[4] = {192, 168, 1, 121};
+uint8_t brokerIp[4] = {192, 168, 1, 50};
+uint8_t subnetMask[4] = {255, 255, 255, 0};
+
+wire toBroker, toBoard;
+mockBroker broker;
+uint8_t boardFrame[FRAME_SIZE];
+socket *board;
+loadRun *run = NULL;                // Being measured
+uint32_t messageSize = LOAD_PAYLOAD;
+
+_callback timerCallbacks[TIMER_SLOTS];
+uint32_t timerTicks[TIMER_SLOTS];
+uint32_t timerPeriods[TIMER_SLOTS];
+bool timerReload[TIMER_SLOTS];
+uint32_t uptime = 0;
+uint32_t randomState = 0x12345678;
+
+//-----------------------------------------------------------------------------
+// Board stand-ins
+//-----------------------------------------------------------------------------
+
+uint16_t htons(uint16_t value)
+{
+    return (value >> 8) | (value << 8);
+}
+
+uint32_t htonl(uint32_t value)
+{
+    return __builtin_bswap32(value);
+}
+
+void getEtherMacAddress(uint8_t mac[6])
+{
+    memcpy(mac, boardMac, 6);
+}
+
+bool putWireFrame(wire *w, void *frame, uint16_t size)
+{
+    uint16_t tail = (w->head + w->count) % WIRE_FRAMES;
+
+    if (w->count == WIRE_FRAMES || size > FRAME_SIZE)
+    {
+        w->drops++;
+        return false;
+    }
+    memcpy(w->frames[tail], frame, size);
+    w->sizes[tail] = size;
+    w->count++;
+    w->bytes += size;
+    return true;
+}
+
+uint16_t getWireFrame(wire *w, uint8_t frame[])
+{
+    uint16_t size;
+
+    if (w->count == 0)
+    {
+        return 0;
+    }
+    size = w->sizes[w->head];
+    memcpy(frame, w->frames[w->head], size);
+    w->head = (w->head + 1) % WIRE_FRAMES;
+    w->count--;
+    return size;
+}
+
+// The ENC28J60 would send it, the broker gets it on the next pump
+bool putEtherPacket(etherHeader *ether, uint16_t size)
+{
+    return putWireFrame(&toBroker, ether, size);
+}
+
+// Same slots and one-second resolution as timer.c, ticked from the host clock
+bool startTimer(_callback callback, uint32_t seconds, bool reload)
+{
+    uint8_t i;
+
+    for (i = 0; i < TIMER_SLOTS; i++)
+    {
+        if (timerCallbacks[i] == NULL)
+        {
+            timerCallbacks[i] = callback;
+            timerTicks[i] = seconds;
+            timerPeriods[i] = seconds;
+            timerReload[i] = reload;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool startOneshotTimer(_callback callback, uint32_t seconds)
+{
+    return startTimer(callback, seconds, false);
+}
+
+bool startPeriodicTimer(_callback callback, uint32_t seconds)
+{
+    return startTimer(callback, seconds, true);
+}
+
+void KillTimer(_callback callback)
+{
+    uint8_t i;
+
+    for (i = 0; i < TIMER_SLOTS; i++)
+    {
+        if (timerCallbacks[i] == callback)
+        {
+            timerCallbacks[i] = NULL;
+            timerTicks[i] = 0;
+        }
+    }
+}
+
+uint32_t getUptime()
+{
+    return uptime;
+}
+
+void tickIsr()
+{
+    uint8_t i;
+    _callback callback;
+
+    uptime++;
+    for (i = 0; i < TIMER_SLOTS; i++)
+    {
+        if (timerTicks[i] > 0 && --timerTicks[i] == 0)
+        {
+            callback = timerCallbacks[i];
+            if (timerReload[i])
+            {
+                timerTicks[i] = timerPeriods[i];
+            }
+            else
+            {
+                timerCallbacks[i] = NULL;
+            }
+            callback();
+        }
+    }
+}
+
+uint32_t random32()
+{
+    randomState = randomState * 1103515245 + 12345;
+    return randomState;
+}
+
+void seedRandom32(uint32_t seed)
+{
+    randomState ^= seed;
+}
+
+void enableRedLED()
+{
+}
+
+void disableRedLED()
+{
+}
+
+//-----------------------------------------------------------------------------
+// Measurement
+//-----------------------------------------------------------------------------
+
+uint64_t getNanoseconds()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+// Message number at the start of a payload
+uint32_t getMessageNumber(const uint8_t data[], uint16_t size)
+{
+    uint32_t number = 0;
+    uint16_t i;
+
+    for (i = 0; i < size && data[i] >= '0' && data[i] <= '9'; i++)
+    {
+        number = number * 10 + data[i] - '0';
+    }
+    return number;
+}
+
+// Zero terminated payload of PAYLOAD bytes starting with the message number
+void putMessage(char str[], uint32_t number)
+{
+    uint32_t length = snprintf(str, messageSize + 1, "%u", number);
+
+    while (length < messageSize)
+    {
+        str[length++] = '.';
+    }
+    str[length] = 0;
+}
+
+void startRun(loadRun *r, const char *name, uint32_t messages)
+{
+    r->name = name;
+    r->messages = messages;
+    r->completed = 0;
+    r->sentAt = calloc(messages, sizeof(uint64_t));
+    r->latency = calloc(messages, sizeof(uint32_t));
+    r->wireBytes = toBroker.bytes + toBoard.bytes;
+    r->start = getNanoseconds();
+    r->end = r->start;
+    run = r;
+}
+
+void completeMessage(uint32_t number)
+{
+    uint64_t now = getNanoseconds();
+
+    if (run != NULL && number < run->messages && run->completed < run->messages)
+    {
+        run->latency[run->completed++] = now - run->sentAt[number];
+        run->end = now;
+    }
+}
+
+int compareLatency(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+// In microseconds
+double getPercentile(loadRun *r, uint8_t percent)
+{
+    uint32_t index = ((uint64_t)r->completed * percent) / 100;
+
+    if (index >= r->completed)
+    {
+        index = r->completed - 1;
+    }
+    return r->latency[index] / 1e3;
+}
+
+void reportRun(loadRun *r)
+{
+    double seconds = (r->end - r->start) / 1e9;
+    uint32_t bytes = toBroker.bytes + toBoard.bytes - r->wireBytes;
+
+    run = NULL;
+    if (r->completed == 0)
+    {
+        printf("%-13s no messages completed\n", r->name);
+    }
+    else
+    {
+        if (seconds <= 0)
+        {
+            seconds = 1e-9;
+        }
+        qsort(r->latency, r->completed, sizeof(uint32_t), compareLatency);
+        printf("%-13s %7u/%u msgs %10.0f msgs/s %12.0f bytes/s  latency us p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+               r->name, r->completed, r->messages, r->completed / seconds, bytes / seconds,
+               getPercentile(r, 50), getPercentile(r, 90), getPercentile(r, 99), getPercentile(r, 100));
+    }
+    free(r->sentAt);
+    free(r->latency);
+}
+
+//-----------------------------------------------------------------------------
+// Mock broker
+//-----------------------------------------------------------------------------
+
+// Builds and queues one segment to the board
+void sendBrokerSegment(uint16_t flags, const uint8_t data[], uint16_t size)
+{
+    uint8_t frame[FRAME_SIZE];
+    etherHeader *ether = (etherHeader*)frame;
+    ipHeader *ip = (ipHeader*)ether->data;
+    tcpHeader *tcp = (tcpHeader*)ip->data;
+    uint8_t headerLength = sizeof(tcpHeader);
+
+    memset(frame, 0, sizeof(etherHeader) + sizeof(ipHeader) + sizeof(tcpHeader) + 4);
+    memcpy(ether->destAddress, broker.boardHwAddress, 6);
+    memcpy(ether->sourceAddress, brokerMac, 6);
+    ether->frameType = htons(TYPE_IP);
+    ip->rev = 4;
+    ip->size = sizeof(ipHeader) / 4;
+    ip->ttl = 64;
+    ip->protocol = PROTOCOL_TCP;
+    memcpy(ip->sourceIp, brokerIp, 4);
+    memcpy(ip->destIp, boardIp, 4);
+    tcp->sourcePort = htons(BROKER_PORT);
+    tcp->destPort = htons(broker.boardPort);
+    tcp->sequenceNumber = htonl(broker.sequenceNumber);
+    tcp->acknowledgementNumber = htonl(broker.acknowledgementNumber);
+    tcp->windowSize = htons(BROKER_WINDOW);
+    if ((flags & SYN) != 0)
+    {
+        // MSS option
+        tcp->data[0] = 2;
+        tcp->data[1] = 4;
+        tcp->data[2] = BROKER_MSS >> 8;
+        tcp->data[3] = BROKER_MSS & 0xFF;
+        headerLength += 4;
+    }
+    tcp->offsetFields = htons(((headerLength / 4) << 12) | flags);
+    memcpy((uint8_t*)tcp + headerLength, data, size);
+    ip->length = htons(sizeof(ipHeader) + headerLength + size);
+    calcIpChecksum(ip);                 // Checked by isIp, the TCP checksum is not
+
+    broker.sequenceNumber += size + ((flags & SYN) != 0);
+    putWireFrame(&toBoard, frame, sizeof(etherHeader) + sizeof(ipHeader) + headerLength + size);
+}
+
+// Adds a control packet to the reply sent once the segment is parsed
+void putBrokerReply(uint8_t headerFlags, const uint8_t body[], uint16_t size)
+{
+    uint8_t *p;
+
+    if (broker.replySize + 2 + size > BROKER_MSS)
+    {
+        sendBrokerSegment(PSH | ACK, broker.reply, broker.replySize);
+        broker.replySize = 0;
+    }
+    p = putMqttHeader(&broker.reply[broker.replySize], headerFlags, size);
+    memcpy(p, body, size);
+    broker.replySize = (p - broker.reply) + size;
+}
+
+// Answers one control packet from the board
+void processBrokerPacket(uint8_t headerFlags, uint8_t body[], uint32_t size)
+{
+    static const uint8_t connack[] = {0, 0};
+    uint8_t suback[2 + MQTT_MAX_SUBSCRIPTIONS];
+    uint16_t topicLength, offset;
+    uint8_t qos;
+
+    switch (headerFlags >> 4)
+    {
+        case MQTT_CONNECT:
+            putBrokerReply(MQTT_CONNACK << 4, connack, sizeof(connack));
+            break;
+        case MQTT_PUBLISH:
+            qos = (headerFlags >> 1) & 3;
+            topicLength = (body[0] << 8) | body[1];
+            offset = 2 + topicLength + (qos > 0 ? 2 : 0);
+            broker.publishes++;
+            if (qos == 0 && offset <= size)
+            {
+                completeMessage(getMessageNumber(&body[offset], size - offset));
+            }
+            if (qos > 0)
+            {
+                putBrokerReply(MQTT_PUBACK << 4, &body[2 + topicLength], 2);
+            }
+            break;
+        case MQTT_SUBSCRIBE:
+            // Packet ID, then a granted QoS 0 per filter
+            suback[0] = body[0];
+            suback[1] = body[1];
+            qos = 0;
+            for (offset = 2; (uint32_t)offset + 2 < size && qos < MQTT_MAX_SUBSCRIPTIONS; qos++)
+            {
+                topicLength = (body[offset] << 8) | body[offset + 1];
+                offset += 2 + topicLength + 1;
+                suback[2 + qos] = 0;
+            }
+            putBrokerReply(MQTT_SUBACK << 4, suback, 2 + qos);
+            break;
+        case MQTT_PINGREQ:
+            putBrokerReply(MQTT_PINGRESP << 4, NULL, 0);
+            break;
+    }
+}
+
+// Parses every complete control packet in the stream
+void processBrokerStream()
+{
+    uint32_t offset = 0, remainingLength;
+    uint8_t lengthBytes;
+
+    while (offset + 2 <= broker.streamSize)
+    {
+        lengthBytes = decodeMqttLength(&broker.stream[offset + 1], broker.streamSize - offset - 1, &remainingLength);
+        if (lengthBytes == 0 || lengthBytes == MQTT_LENGTH_INVALID
+            || offset + 1 + lengthBytes + remainingLength > broker.streamSize)
+        {
+            break;
+        }
+        processBrokerPacket(broker.stream[offset], &broker.stream[offset + 1 + lengthBytes], remainingLength);
+        offset += 1 + lengthBytes + remainingLength;
+    }
+    memmove(broker.stream, &broker.stream[offset], broker.streamSize - offset);
+    broker.streamSize -= offset;
+}
+
+// Handles one frame the board sent
+void processBrokerFrame(uint8_t frame[], uint16_t size)
+{
+    etherHeader *ether = (etherHeader*)frame;
+    arpPacket *arp = (arpPacket*)ether->data;
+    ipHeader *ip = (ipHeader*)ether->data;
+    tcpHeader *tcp = (tcpHeader*)((uint8_t*)ip + ip->size * 4);
+    uint16_t flags, dataSize;
+    uint32_t sequenceNumber;
+
+    // Answers ARP for the broker
+    if (ether->frameType == htons(TYPE_ARP))
+    {
+        if (arp->op == htons(1) && memcmp(arp->destIp, brokerIp, 4) == 0)
+        {
+            arp->op = htons(2);
+            memcpy(arp->destAddress, arp->sourceAddress, 6);
+            memcpy(arp->destIp, arp->sourceIp, 4);
+            memcpy(arp->sourceAddress, brokerMac, 6);
+            memcpy(arp->sourceIp, brokerIp, 4);
+            memcpy(ether->destAddress, ether->sourceAddress, 6);
+            memcpy(ether->sourceAddress, brokerMac, 6);
+            putWireFrame(&toBoard, frame, size);
+        }
+        return;
+    }
+    if (ether->frameType != htons(TYPE_IP) || ip->protocol != PROTOCOL_TCP)
+    {
+        return;
+    }
+
+    flags = ntohs(tcp->offsetFields) & 0x1FF;
+    dataSize = ntohs(ip->length) - ip->size * 4 - (ntohs(tcp->offsetFields) >> 12) * 4;
+    sequenceNumber = ntohl(tcp->sequenceNumber);
+    broker.boardWindow = ntohs(tcp->windowSize);
+    if ((flags & ACK) != 0 && (int32_t)(ntohl(tcp->acknowledgementNumber) - broker.boardAcked) > 0)
+    {
+        broker.boardAcked = ntohl(tcp->acknowledgementNumber);
+    }
+
+    if ((flags & RST) != 0)
+    {
+        broker.connected = false;
+        return;
+    }
+    if ((flags & SYN) != 0)
+    {
+        memcpy(broker.boardHwAddress, ether->sourceAddress, 6);
+        broker.boardPort = ntohs(tcp->sourcePort);
+        broker.acknowledgementNumber = sequenceNumber + 1;
+        broker.sequenceNumber = random32();
+        broker.boardAcked = broker.sequenceNumber + 1;
+        broker.streamSize = 0;
+        broker.connected = true;
+        sendBrokerSegment(SYN | ACK, NULL, 0);
+        return;
+    }
+
+    // In order data is parsed, anything else is a retransmission and only acknowledged
+    if (dataSize > 0 && sequenceNumber == broker.acknowledgementNumber
+        && broker.streamSize + dataSize <= BROKER_STREAM_SIZE)
+    {
+        memcpy(&broker.stream[broker.streamSize], (uint8_t*)tcp + (ntohs(tcp->offsetFields) >> 12) * 4, dataSize);
+        broker.streamSize += dataSize;
+        broker.acknowledgementNumber += dataSize;
+        processBrokerStream();
+    }
+    if ((flags & FIN) != 0)
+    {
+        broker.acknowledgementNumber++;
+        broker.connected = false;
+        sendBrokerSegment(FIN | ACK, NULL, 0);
+        return;
+    }
+    if (broker.replySize > 0)
+    {
+        sendBrokerSegment(PSH | ACK, broker.reply, broker.replySize);
+        broker.replySize = 0;
+    }
+    else if (dataSize > 0)
+    {
+        sendBrokerSegment(ACK, NULL, 0);
+    }
+}
+
+// Sends PUBLISHes from many publishers to the board, as many as the board's window takes
+// Returns the number of messages sent
+uint32_t sendBrokerPublishes(uint32_t first, uint32_t last, uint16_t publishers)
+{
+    uint8_t data[BROKER_MSS];
+    uint16_t size = 0;
+    char topic[32], payload[256];
+    uint16_t topicLength, packetSize;
+    uint32_t number = first;
+    uint8_t *p;
+
+    while (number < last)
+    {
+        topicLength = snprintf(topic, sizeof(topic), "load/%u/value", number % publishers);
+        putMessage(payload, number);
+        packetSize = 2 + 2 + topicLength + messageSize;     // Remaining Length of 1 or 2 bytes
+        packetSize += (packetSize - 2 > 127);
+        if (size + packetSize > BROKER_MSS
+            || (uint32_t)(broker.sequenceNumber + size + packetSize - broker.boardAcked) > broker.boardWindow)
+        {
+            break;
+        }
+        p = putMqttHeader(&data[size], MQTT_PUBLISH << 4, 2 + topicLength + messageSize);
+        *p++ = topicLength >> 8;
+        *p++ = topicLength & 0xFF;
+        memcpy(p, topic, topicLength);
+        memcpy(p + topicLength, payload, messageSize);
+        size = (p + topicLength + messageSize) - data;
+        run->sentAt[number++] = getNanoseconds();
+    }
+    if (size > 0)
+    {
+        sendBrokerSegment(PSH | ACK, data, size);
+    }
+    return number - first;
+}
+
+//-----------------------------------------------------------------------------
+// Board main loop
+//-----------------------------------------------------------------------------
+
+void loadSocketConnected(etherHeader *ether, socket *s)
+{
+    connectMqtt(ether, s);
+}
+
+void loadSocketReceived(etherHeader *ether, socket *s, uint8_t data[], uint16_t size)
+{
+    processMqttData(ether, s, data, size);
+}
+
+void loadSocketClosed(socket *s)
+{
+    resetMqtt();
+}
+
+const socketCallbacks loadSocketCallbacks = {loadSocketConnected, loadSocketReceived, NULL, loadSocketClosed};
+
+// The board's shared 1 second timer, less the modules the harness does not link
+void callbackLoadTimer()
+{
+    callbackTcpTimer();
+    mqttTick();
+}
+
+void loadPublishComplete(uint16_t packetId, void *context)
+{
+    completeMessage((uintptr_t)context);
+}
+
+void loadMessageReceived(char topic[], uint16_t topicLength, uint8_t data[], uint16_t dataLength, void *context)
+{
+    completeMessage(getMessageNumber(data, dataLength));
+}
+
+// One pass of the board's main loop and of the broker, ticks the timers each second
+void pump()
+{
+    static uint64_t nextTick = 0;
+    uint8_t frame[FRAME_SIZE];
+    uint16_t size;
+    socket *s;
+
+    if (getNanoseconds() >= nextTick)
+    {
+        if (nextTick != 0)
+        {
+            tickIsr();
+        }
+        nextTick = getNanoseconds() + 1000000000;
+    }
+
+    sendTcpPendingMessages((etherHeader*)boardFrame);
+    sendMqttPendingMessages((etherHeader*)boardFrame, board);
+
+    while ((size = getWireFrame(&toBroker, frame)) > 0)
+    {
+        processBrokerFrame(frame, size);
+    }
+
+    // Same routing as ethernet.c
+    while (getWireFrame(&toBoard, boardFrame) > 0)
+    {
+        etherHeader *ether = (etherHeader*)boardFrame;
+
+        if (isArpResponse(ether))
+        {
+            processTcpArpResponse(ether, board);
+        }
+        else if (isIp(ether) && isTcp(ether))
+        {
+            s = findTcpSocket(ether);
+            if (s != NULL)
+            {
+                processTcpResponse(ether, s);
+            }
+        }
+    }
+}
+
+bool isTimedOut(loadRun *r)
+{
+    return getNanoseconds() - r->start > (uint64_t)LOAD_TIMEOUT_S * 1000000000;
+}
+
+// Publishes as fast as the board takes them
+// QoS 1 fills the in-flight window before each pass, QoS 0 sends one message per pass so
+// TCP always has room for it, publishMqtt would drop it otherwise
+void runPublish(loadRun *r, const char *name, uint32_t messages, bool qos1)
+{
+    uint8_t topic = findMqttTopic("load/board");
+    char payload[256];
+    uint32_t number = 0;
+    bool sent = true;
+
+    startRun(r, name, messages);
+    while (r->completed < messages && !isTimedOut(r))
+    {
+        sent = true;
+        while (number < messages && sent)
+        {
+            putMessage(payload, number);
+            r->sentAt[number] = getNanoseconds();
+            if (qos1)
+            {
+                sent = publishMqttQos1((etherHeader*)boardFrame, board, topic, payload,
+                                       loadPublishComplete, (void*)(uintptr_t)number) != 0;
+            }
+            else
+            {
+                publishMqtt((etherHeader*)boardFrame, board, topic, payload);
+            }
+            number += sent;
+            sent &= qos1;
+        }
+        pump();
+
+        // QoS 0 messages lost on the way are reported as missing
+        if (!qos1 && number == messages && board->sendUnacked == board->sequenceNumber)
+        {
+            break;
+        }
+    }
+    reportRun(r);
+}
+
+// Broker pushes PUBLISHes from many topics into one subscription
+void runFanIn(loadRun *r, uint32_t messages, uint16_t publishers)
+{
+    uint32_t number = 0;
+
+    startRun(r, "fan-in", messages);
+    while (r->completed < messages && !isTimedOut(r))
+    {
+        if (number < messages)
+        {
+            number += sendBrokerPublishes(number, messages, publishers);
+        }
+        pump();
+    }
+    reportRun(r);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t messages = (argc > 1) ? strtoul(argv[1], NULL, 10) : LOAD_MESSAGES;
+    uint16_t publishers = (argc > 3) ? strtoul(argv[3], NULL, 10) : LOAD_PUBLISHERS;
+    uint64_t start;
+    loadRun r;
+
+    messageSize = (argc > 2) ? strtoul(argv[2], NULL, 10) : LOAD_PAYLOAD;
+    if (messages == 0 || publishers == 0 || messageSize < 10 || messageSize > MQTT_INFLIGHT_PACKET_SIZE - 32)
+    {
+        printf("Usage: mqttload [MESSAGES [PAYLOAD 10-%u [PUBLISHERS]]]\n", MQTT_INFLIGHT_PACKET_SIZE - 32);
+        return 1;
+    }
+
+    setIpAddress(boardIp);
+    setIpSubnetMask(subnetMask);
+    setIpGatewayAddress(brokerIp);
+    initSockets();
+    startPeriodicTimer(callbackLoadTimer, 1);
+    registerMqttTopic("load/board", NULL);
+    subscribeMqtt("load/+/value", loadMessageReceived, NULL);
+
+    board = newSocket();
+    setSocketCallbacks(board, &loadSocketCallbacks, NULL);
+    addMqttBroker(brokerIp, BROKER_PORT, 0);
+    startMqttConnection(board);
+
+    // CONNECT and SUBSCRIBE
+    start = getNanoseconds();
+    while (!(isMqttConAcked() && isMqttSubAcked(0)) && getNanoseconds() - start < (uint64_t)LOAD_TIMEOUT_S * 1000000000)
+    {
+        pump();
+    }
+    if (!isMqttConAcked())
+    {
+        printf("No connection to the mock broker\n");
+        return 1;
+    }
+
+    printf("%u messages, %u byte payloads, %u publishers\n", messages, messageSize, publishers);
+    runPublish(&r, "publish qos0", messages, false);
+    runPublish(&r, "publish qos1", messages, true);
+    runFanIn(&r, messages, publishers);
+    if (toBroker.drops + toBoard.drops > 0)
+    {
+        printf("Wire drops: %u to broker, %u to board\n", toBroker.drops, toBoard.drops);
+    }
+    return 0;
+}
+
+#endif
@@ -156,20 +156,30 @@ void getIpTimeServerAddress(uint8_t ip[4])
         ip[i] = ipTimeServerAddress[i];
 }
 
-// Sets IP time server address
+// Sets IP MQTT broker address
 void setIpMqttBrokerAddress(const uint8_t ip[4])
 {
     uint8_t i;
     for (i = 0; i < IP_ADD_LENGTH; i++)
-        ipTimeServerAddress[i] = ip[i];
+        ipMqttBrokerAddress[i] = ip[i];
 }
 
-// Gets IP time server address
+// Gets IP MQTT broker address
 void getIpMqttBrokerAddress(uint8_t ip[4])
 {
     uint8_t i;
     for (i = 0; i < IP_ADD_LENGTH; i++)
-        ip[i] = ipTimeServerAddress[i];
+        ip[i] = ipMqttBrokerAddress[i];
+}
+
+// Determines whether an address is on our subnet, reached without the gateway
+bool isIpLocal(const uint8_t ip[4])
+{
+    uint8_t i;
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+        if ((ip[i] & ipSubnetMask[i]) != (ipAddress[i] & ipSubnetMask[i]))
+            return false;
+    return true;
 }
 
 // Calculate sum of words
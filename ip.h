@@ -67,6 +67,7 @@ void setIpTimeServerAddress(const uint8_t ip[4]);
 void getIpTimeServerAddress(uint8_t ip[4]);
 void setIpMqttBrokerAddress(const uint8_t ip[4]);
 void getIpMqttBrokerAddress(uint8_t ip[4]);
+bool isIpLocal(const uint8_t ip[4]);
 
 void sumIpWords(void* data, uint16_t sizeInBytes, uint32_t* sum);
 void calcIpChecksum(ipHeader* ip);
@@ -0,0 +1,158 @@
+// JSON Writer
+// Streaming JSON output for human readable payloads
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: -
+// Target uC:       -
+// System Clock:    -
+
+// Hardware configuration:
+// -
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+// Text is written straight into the caller's buffer, typically the payload area of an
+// outbound frame. Numbers are formatted with integer division into their final place,
+// there is no snprintf, heap or scratch string. key is NULL for the outermost object.
+
+#include <string.h>
+#include "json.h"
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+void initJsonWriter(jsonWriter *w, char data[], uint16_t size)
+{
+    w->data = data;
+    w->size = size;
+    w->length = 0;
+    w->overflow = false;
+    w->needComma = false;
+}
+
+// Reserves size characters, NULL once the buffer is full
+char* getJsonSpace(jsonWriter *w, uint16_t size)
+{
+    char *p;
+
+    if (w->overflow || size > w->size - w->length)
+    {
+        w->overflow = true;
+        return NULL;
+    }
+    p = &w->data[w->length];
+    w->length += size;
+    return p;
+}
+
+void putJsonChar(jsonWriter *w, char c)
+{
+    char *p = getJsonSpace(w, 1);
+
+    if (p != NULL)
+    {
+        *p = c;
+    }
+}
+
+// Quoted string, " \ and control characters escaped
+void putJsonText(jsonWriter *w, char str[])
+{
+    char *p;
+    char c;
+
+    putJsonChar(w, '"');
+    while ((c = *str++) != 0)
+    {
+        if (c == '"' || c == '\\')
+        {
+            putJsonChar(w, '\\');
+            putJsonChar(w, c);
+        }
+        else if ((uint8_t)c < 0x20)
+        {
+            p = getJsonSpace(w, 6);
+            if (p != NULL)
+            {
+                memcpy(p, "\\u00", 4);
+                p[4] = "0123456789abcdef"[c >> 4];
+                p[5] = "0123456789abcdef"[c & 0x0F];
+            }
+        }
+        else
+        {
+            putJsonChar(w, c);
+        }
+    }
+    putJsonChar(w, '"');
+}
+
+// Comma before every member but the first, then "key":
+void putJsonKey(jsonWriter *w, char key[])
+{
+    if (w->needComma)
+    {
+        putJsonChar(w, ',');
+    }
+    w->needComma = true;
+    if (key != NULL)
+    {
+        putJsonText(w, key);
+        putJsonChar(w, ':');
+    }
+}
+
+// Digits are counted first so they can be written in place from the right
+void putJsonDigits(jsonWriter *w, uint32_t value)
+{
+    uint32_t rest = value;
+    uint8_t count = 1;
+    char *p;
+
+    while (rest >= 10)
+    {
+        rest /= 10;
+        count++;
+    }
+    p = getJsonSpace(w, count);
+    if (p == NULL)
+    {
+        return;
+    }
+    while (count > 0)
+    {
+        p[--count] = '0' + value % 10;
+        value /= 10;
+    }
+}
+
+void startJsonObject(jsonWriter *w, char key[])
+{
+    putJsonKey(w, key);
+    putJsonChar(w, '{');
+    w->needComma = false;
+}
+
+void endJsonObject(jsonWriter *w)
+{
+    putJsonChar(w, '}');
+    w->needComma = true;
+}
+
+void putJsonUint(jsonWriter *w, char key[], uint32_t value)
+{
+    putJsonKey(w, key);
+    putJsonDigits(w, value);
+}
+
+// Characters written, 0 if the buffer was too small
+uint16_t getJsonLength(jsonWriter *w)
+{
+    return w->overflow ? 0 : w->length;
+}
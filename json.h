@@ -0,0 +1,44 @@
+// JSON Writer
+// Streaming JSON output for human readable payloads
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: -
+// Target uC:       -
+// System Clock:    -
+
+// Hardware configuration:
+// -
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#ifndef JSON_H_
+#define JSON_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct _jsonWriter
+{
+    char *data;
+    uint16_t size;                  // Room in data
+    uint16_t length;                // Characters written so far
+    bool overflow;                  // Something did not fit, nothing more is written
+    bool needComma;                 // A member was written since the last {
+} jsonWriter;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+void initJsonWriter(jsonWriter *w, char data[], uint16_t size);
+void startJsonObject(jsonWriter *w, char key[]);
+void endJsonObject(jsonWriter *w);
+void putJsonUint(jsonWriter *w, char key[], uint32_t value);
+uint16_t getJsonLength(jsonWriter *w);
+
+#endif
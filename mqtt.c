@@ -27,8 +27,6 @@
 #include "timer.h"
 //#include "parser.h"
 
-#define MAX_BUFF_SIZE 64
-
 
 
 // ------------------------------------------------------------------------------
@@ -36,8 +34,46 @@
 // ------------------------------------------------------------------------------
 
 bool mqttConnected = false;
-bool mqttSubscribed = false;
-uint16_t subbedTopicLength = 0;
+bool mqttCleanSession = false;      // Persistent by default, the broker keeps subscriptions
+bool mqttSessionPresent = false;
+uint8_t mqttVersion = MQTT_VERSION_311;         // Of the current connection
+uint8_t mqttNextVersion = MQTT_VERSION_311;
+uint8_t mqttReasonCode = 0;         // Last return or reason code from the broker
+uint16_t mqttReceiveMax = 0xFFFF;   // QoS 1 PUBLISHes the broker takes before a PUBACK
+uint16_t mqttTopicAliasMax = 0;     // MQTT 5.0, aliases the broker accepts on this connection
+uint16_t mqttAliasesSent = 0;       // Bit per topic whose alias the broker knows
+uint16_t mqttAliasesPending = 0;    // Introduced by PUBLISHes waiting in a batch
+uint16_t mqttPublishAlias = 0;      // Introduced by the last PUBLISH built
+mqttDecoder mqttRx;
+mqttInflightMessage mqttInflight[MQTT_INFLIGHT_WINDOW];
+uint16_t mqttPacketId = 0;
+uint16_t mqttPublishOrder = 0;
+bool mqttBatching = false;
+uint16_t mqttBatchSize = 0;
+uint8_t mqttBatchInflight = 0;      // Bit per in-flight slot sent with the batch
+mqttTopicEntry mqttTopics[MQTT_MAX_TOPICS];
+uint8_t mqttTopicCount = 0;
+uint8_t mqttTopicBlob[MQTT_TOPIC_BLOB_SIZE];
+uint16_t mqttTopicBlobSize = 0;
+mqttSubscription mqttSubscriptions[MQTT_MAX_SUBSCRIPTIONS];
+mqttTrieNode mqttTrie[MQTT_TRIE_NODES];
+uint8_t mqttTrieRoot = MQTT_TRIE_NONE;
+// Seconds counted by the timer ISR and those already run by sendMqttPendingMessages,
+// everything else here is only touched from the main loop
+volatile uint8_t mqttTicks = 0;
+uint8_t mqttTicksDone = 0;
+uint16_t mqttIdle = 0;              // Seconds since a packet went out
+uint16_t mqttKeepAlive = MQTT_KEEPALIVE_S;  // MQTT 5.0 brokers may set their own, 0 is none
+uint8_t mqttResponseTimer = 0;      // Counts down while a CONNACK or PINGRESP is due
+bool mqttPingNeeded = false;
+bool mqttLost = false;              // No CONNACK or PINGRESP in time
+uint8_t mqttReconnectAttempts = 0;
+uint16_t mqttReconnectTimer = 0;    // Seconds until the next connection attempt, 0 if none
+bool mqttReconnectNeeded = false;
+mqttBroker mqttBrokers[MQTT_MAX_BROKERS];
+uint8_t mqttCurrentBroker = MQTT_BROKER_INVALID;    // Of the current or last connection
+uint32_t mqttConnectedAt = 0;
+bool mqttFailingBack = false;       // Left a backup on purpose, not a failure
 
 // ------------------------------------------------------------------------------
 //  Structures
@@ -72,245 +108,1556 @@ int32_t atoi(char* str)
 }
 
 
+// Writes a Remaining Length, returns the number of bytes used
+uint8_t encodeMqttLength(uint8_t data[], uint32_t length)
+{
+    uint8_t count = 0;
+
+    do
+    {
+        data[count] = length & 0x7F;
+        length >>= 7;
+        if (length > 0)
+        {
+            data[count] |= 0x80;
+        }
+        count++;
+    } while (length > 0 && count < MQTT_MAX_LENGTH_BYTES);
+
+    return count;
+}
+
+// Reads a Remaining Length from size bytes of data
+// Returns the number of bytes used, 0 if more are needed or MQTT_LENGTH_INVALID if
+// the value runs past four bytes
+uint8_t decodeMqttLength(uint8_t data[], uint16_t size, uint32_t *length)
+{
+    uint8_t count = 0;
+    uint32_t value = 0;
+
+    while (count < size)
+    {
+        value |= (uint32_t)(data[count] & 0x7F) << (7 * count);
+        if ((data[count++] & 0x80) == 0)
+        {
+            *length = value;
+            return count;
+        }
+        if (count == MQTT_MAX_LENGTH_BYTES)
+        {
+            return MQTT_LENGTH_INVALID;
+        }
+    }
+    return 0;
+}
+
+// Writes the fixed header, returns where the variable header goes
+uint8_t* putMqttHeader(uint8_t data[], uint8_t headerFlags, uint32_t remainingLength)
+{
+    mqttHeader *mqtt = (mqttHeader*) data;
+
+    mqtt->headerFlags = headerFlags;
+    return mqtt->remainingLength + encodeMqttLength(mqtt->remainingLength, remainingLength);
+}
+
+// Counts seconds for processMqttTimers, called from the shared 1 second timer
+void mqttTick()
+{
+    mqttTicks++;
+}
+
+// Keepalive, reply timeout and reconnect backoff for every second counted since the last call
+void processMqttTimers()
+{
+    while (mqttTicksDone != mqttTicks)
+    {
+        mqttTicksDone++;
+        if (mqttResponseTimer > 0 && --mqttResponseTimer == 0)
+        {
+            mqttLost = true;
+        }
+
+        // Only idle time counts, any packet sent resets it
+        if (mqttConnected && mqttKeepAlive > 0 && mqttResponseTimer == 0 && ++mqttIdle >= mqttKeepAlive)
+        {
+            mqttPingNeeded = true;
+        }
+
+        if (mqttReconnectTimer > 0 && --mqttReconnectTimer == 0)
+        {
+            mqttReconnectNeeded = true;
+        }
+    }
+}
+
+// Sends an MQTT packet built at reserveTcpMessage
+// Topic aliases introduced by it are known to the broker once it is sent
+bool commitMqttMessage(etherHeader *ether, socket *s, uint16_t size)
+{
+    uint16_t aliases = mqttAliasesPending;
+
+    mqttAliasesPending = 0;
+    if (!commitTcpMessage(ether, s, PSH | ACK, size))
+    {
+        return false;
+    }
+    mqttIdle = 0;
+    mqttAliasesSent |= aliases;
+    return true;
+}
+
+// MQTT_VERSION_311 or MQTT_VERSION_5, takes effect on the next CONNECT
+void setMqttVersion(uint8_t version)
+{
+    mqttNextVersion = version;
+}
+
+uint8_t getMqttVersion()
+{
+    return mqttNextVersion;
+}
+
+// Takes effect on the next CONNECT
+void setMqttCleanSession(bool clean)
+{
+    mqttCleanSession = clean;
+}
+
+// Writes the client ID, a persistent session is only found again under the same ID
+uint16_t putMqttClientId(uint8_t data[])
+{
+    uint8_t mac[HW_ADD_LENGTH];
+    uint16_t length = strlen(MQTT_CLIENT_ID_PREFIX);
+    uint8_t i;
+
+    memcpy(data, MQTT_CLIENT_ID_PREFIX, length);
+    getEtherMacAddress(mac);
+    for (i = 0; i < HW_ADD_LENGTH; i++)
+    {
+        data[length++] = "0123456789abcdef"[mac[i] >> 4];
+        data[length++] = "0123456789abcdef"[mac[i] & 0x0F];
+    }
+    return length;
+}
+
 void connectMqtt(etherHeader *ether, socket *s)
 {
-    // MQTT "Header"
-    uint8_t buffer[MAX_BUFF_SIZE];
-    mqttHeader* mqtt = (mqttHeader*) buffer;
+    // MQTT "Header", built in place in the outbound frame
+    uint8_t *start = reserveTcpMessage(ether, s, NULL);
+    uint16_t clientIdLength = strlen(MQTT_CLIENT_ID_PREFIX) + 2 * HW_ADD_LENGTH;
+    bool v5 = (mqttNextVersion == MQTT_VERSION_5);
+    uint8_t propertiesLength = (v5 && !mqttCleanSession) ? 5 : 0;  // Session expiry
+    uint32_t remainingLength = sizeof(mqttConnect) + clientIdLength + v5 + propertiesLength;
+    uint8_t *p;
+
+    // New connection, new byte stream
+    mqttRx.state = MQTT_DECODE_HEADER;
+    mqttVersion = mqttNextVersion;
+
+    // MQTT Connect Payload, laid out as mqttConnect and written through a byte cursor
+    // since the client ID runs past the end of the struct
+    p = putMqttHeader(start, 0x10, remainingLength);    // Connect Flag
+
+    *p++ = 0x00;                                    // Length of MQTT
+    *p++ = 0x04;
+    *p++ = 0x4D;                                    // M
+    *p++ = 0x51;                                    // Q
+    *p++ = 0x54;                                    // T
+    *p++ = 0x54;                                    // T
+    *p++ = mqttVersion;                             // Version v3.1.1 or v5.0
+    *p++ = mqttCleanSession ? 0x02 : 0x00;          // Clean session
+    *p++ = MQTT_KEEPALIVE_S >> 8;                   // Keep alive
+    *p++ = MQTT_KEEPALIVE_S & 0xFF;
+
+    // MQTT 5.0 properties go before the client ID, a session is kept only with an expiry
+    if (v5)
+    {
+        *p++ = propertiesLength;
+    }
+    if (propertiesLength > 0)
+    {
+        *p++ = MQTT_PROP_SESSION_EXPIRY;
+        *p++ = (MQTT_SESSION_EXPIRY_S >> 24) & 0xFF;
+        *p++ = (MQTT_SESSION_EXPIRY_S >> 16) & 0xFF;
+        *p++ = (MQTT_SESSION_EXPIRY_S >> 8) & 0xFF;
+        *p++ = MQTT_SESSION_EXPIRY_S & 0xFF;
+    }
+    *p++ = clientIdLength >> 8;
+    *p++ = clientIdLength & 0xFF;
+    p += putMqttClientId(p);
 
-    mqtt->headerFlags = 0x10;   // Connect Flag
+    // adjust lengths
+    uint16_t dataSize = p - start;
 
-    // MQTT Connect Payload
-    mqttConnect *payload = (mqttConnect*) mqtt->lengthPayload;
+    // Send the MQTT Connect message, the broker has a while to answer
+    commitMqttMessage(ether, s, dataSize);
+    mqttResponseTimer = MQTT_RESPONSE_TIMEOUT_S;
+}
 
-    payload->protocolNameLength = htons(0x0004);    // Length of MQTT
-    payload->protocolName[0] = 0x4D;                // M
-    payload->protocolName[1] = 0x51;                // Q
-    payload->protocolName[2] = 0x54;                // T
-    payload->protocolName[3] = 0x54;                // T
-    payload->version = 0x04;                        // Version v3.1.1
-    payload->connectFlags = 0x02;                   // Clean session... More suitable for Publish only client.
-    payload->keepAlive = htons(0x003c);             // Keep alive 60s
-    payload->clientIdLength = htons(0x0);           // Length of client ID
+// The broker closes the connection when it gets this
+void sendMqttDisconnect(etherHeader *ether, socket *s)
+{
+    mqttConnected = false;
+
+    // MQTT "Header", built in place in the outbound frame
+    uint8_t *start = reserveTcpMessage(ether, s, NULL);
+    uint8_t *end = putMqttHeader(start, 0xE0, 0);     // Disconnect Flag
 
     // adjust lengths
-    mqtt->msgLen = sizeof(mqttConnect);        
-    uint8_t dataSize = sizeof(mqttHeader) + mqtt->msgLen;
+    uint16_t dataSize = end - start;
 
-    // Send the MQTT Connect message
-    sendTcpMessage(ether, s, PSH | ACK, (uint8_t *)mqtt, dataSize);
+    commitMqttMessage(ether, s, dataSize);
 }
 
 void disconnectMqtt(etherHeader *ether, socket *s)
 {
+    // Leaving on purpose, no reconnect
+    mqttReconnectTimer = 0;
+    mqttReconnectNeeded = false;
+    mqttReconnectAttempts = 0;
 
-    mqttConnected = false;
+    sendMqttDisconnect(ether, s);
+}
 
-    // MQTT "Header"
-    uint8_t buffer[MAX_BUFF_SIZE];
-    mqttHeader* mqtt = (mqttHeader*) buffer;
+// Adds a broker, or changes the priority of one already in the list
+// Returns its index, MQTT_BROKER_INVALID if the list is full
+uint8_t addMqttBroker(const uint8_t ip[4], uint16_t port, uint8_t priority)
+{
+    uint8_t i, free = MQTT_BROKER_INVALID;
+    mqttBroker *broker;
 
-    mqtt->headerFlags = 0xE0;   // Connect Flag
-    mqtt->lengthPayload[0] = 0x0;
+    for (i = 0; i < MQTT_MAX_BROKERS; i++)
+    {
+        broker = &mqttBrokers[i];
+        if (broker->inUse && memcmp(broker->ip, ip, IP_ADD_LENGTH) == 0 && broker->port == port)
+        {
+            broker->priority = priority;
+            return i;
+        }
+        if (!broker->inUse && free == MQTT_BROKER_INVALID)
+        {
+            free = i;
+        }
+    }
+    if (free != MQTT_BROKER_INVALID)
+    {
+        broker = &mqttBrokers[free];
+        memcpy(broker->ip, ip, IP_ADD_LENGTH);
+        broker->port = port;
+        broker->priority = priority;
+        broker->failures = 0;
+        broker->retryAt = 0;
+        broker->inUse = true;
+    }
+    return free;
+}
 
-    // adjust lengths
-    mqtt->msgLen = 0x0;    
-    uint8_t dataSize = sizeof(mqttHeader) + mqtt->msgLen;
+// The current connection is left alone until it ends
+void clearMqttBrokers()
+{
+    uint8_t i;
+
+    for (i = 0; i < MQTT_MAX_BROKERS; i++)
+    {
+        mqttBrokers[i].inUse = false;
+    }
+}
+
+mqttBroker* getMqttBroker(uint8_t broker)
+{
+    return (broker < MQTT_MAX_BROKERS && mqttBrokers[broker].inUse) ? &mqttBrokers[broker] : NULL;
+}
+
+uint8_t getMqttCurrentBroker()
+{
+    return mqttCurrentBroker;
+}
+
+// Most preferred broker that is not held down, or the one whose hold down ends first
+uint8_t findMqttBroker()
+{
+    uint32_t now = getUptime();
+    uint8_t i, best = MQTT_BROKER_INVALID, soonest = MQTT_BROKER_INVALID;
+    mqttBroker *broker;
+
+    for (i = 0; i < MQTT_MAX_BROKERS; i++)
+    {
+        broker = &mqttBrokers[i];
+        if (!broker->inUse)
+        {
+            continue;
+        }
+        if ((int32_t)(now - broker->retryAt) >= 0)
+        {
+            if (best == MQTT_BROKER_INVALID || broker->priority < mqttBrokers[best].priority)
+            {
+                best = i;
+            }
+        }
+        else if (soonest == MQTT_BROKER_INVALID || (int32_t)(broker->retryAt - mqttBrokers[soonest].retryAt) < 0)
+        {
+            soonest = i;
+        }
+    }
+    return (best != MQTT_BROKER_INVALID) ? best : soonest;
+}
+
+// Starts the active open to the best broker
+// Returns false if there is none
+bool startMqttConnection(socket *s)
+{
+    mqttBroker *broker;
+
+    mqttCurrentBroker = findMqttBroker();
+    if (mqttCurrentBroker == MQTT_BROKER_INVALID)
+    {
+        return false;
+    }
+    broker = &mqttBrokers[mqttCurrentBroker];
+    memcpy(s->remoteIpAddress, broker->ip, IP_ADD_LENGTH);
+    s->remotePort = broker->port;
+    sendTcpArpRequest(s);
+    return true;
+}
+
+// Holds the broker down for longer with each failure in a row
+void failMqttBroker(uint8_t broker)
+{
+    uint8_t shift;
+
+    if (getMqttBroker(broker) == NULL)
+    {
+        return;
+    }
+    if (mqttBrokers[broker].failures < 255)
+    {
+        mqttBrokers[broker].failures++;
+    }
+    shift = (mqttBrokers[broker].failures > 4) ? 4 : mqttBrokers[broker].failures - 1;
+    mqttBrokers[broker].retryAt = getUptime() + ((uint32_t)MQTT_BROKER_HOLD_S << shift);
+}
+
+// FNV-1a, used to find topics without comparing strings
+uint32_t hashMqttTopic(const char str[], uint16_t length)
+{
+    uint32_t hash = 2166136261;
+    uint16_t i;
+
+    for (i = 0; i < length; i++)
+    {
+        hash ^= (uint8_t)str[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+// Encodes a topic once into its length-prefixed wire form and returns its handle
+// alias is an optional short name for findMqttTopic, NULL if none
+// Returns MQTT_TOPIC_INVALID when the registry is full
+uint8_t registerMqttTopic(char strTopic[], char strAlias[])
+{
+    uint16_t topicLength = strlen(strTopic);
+    uint16_t aliasLength = (strAlias != NULL) ? strlen(strAlias) : 0;
+    mqttTopicEntry *topic;
+    uint8_t *blob;
+
+    if (mqttTopicCount == MQTT_MAX_TOPICS
+        || mqttTopicBlobSize + sizeof(uint16_t) + topicLength + aliasLength > MQTT_TOPIC_BLOB_SIZE)
+    {
+        return MQTT_TOPIC_INVALID;
+    }
 
-    sendTcpMessage(ether, s, PSH | ACK, (uint8_t *)mqtt, dataSize);
+    topic = &mqttTopics[mqttTopicCount];
+    topic->offset = mqttTopicBlobSize;
+    topic->size = sizeof(uint16_t) + topicLength;
+    topic->hash = hashMqttTopic(strTopic, topicLength);
+    topic->aliasLength = aliasLength;
+    topic->aliasHash = hashMqttTopic(strAlias, aliasLength);
+
+    // Wire form, alias follows it
+    blob = &mqttTopicBlob[topic->offset];
+    blob[0] = topicLength >> 8;
+    blob[1] = topicLength & 0xFF;
+    memcpy(&blob[2], strTopic, topicLength);
+    memcpy(&blob[topic->size], strAlias, aliasLength);
+    mqttTopicBlobSize += topic->size + aliasLength;
+
+    return mqttTopicCount++;
+}
+
+// Name of a registered topic, not zero terminated, NULL if there is no such topic
+char* getMqttTopicName(uint8_t topic, uint16_t *length)
+{
+    if (topic >= mqttTopicCount)
+    {
+        return NULL;
+    }
+    if (length != NULL)
+    {
+        *length = mqttTopics[topic].size - 2;
+    }
+    return (char*)&mqttTopicBlob[mqttTopics[topic].offset + 2];
+}
+
+// Handle of a registered topic given its full name or alias, MQTT_TOPIC_INVALID if none
+uint8_t findMqttTopic(char str[])
+{
+    uint16_t length = strlen(str);
+    uint32_t hash = hashMqttTopic(str, length);
+    mqttTopicEntry *topic;
+    uint8_t *blob;
+    uint8_t i;
+
+    for (i = 0; i < mqttTopicCount; i++)
+    {
+        topic = &mqttTopics[i];
+        blob = &mqttTopicBlob[topic->offset];
+        if (topic->hash == hash && topic->size == sizeof(uint16_t) + length
+            && memcmp(&blob[2], str, length) == 0)
+        {
+            return i;
+        }
+        if (topic->aliasLength > 0 && topic->aliasHash == hash && topic->aliasLength == length
+            && memcmp(&blob[topic->size], str, length) == 0)
+        {
+            return i;
+        }
+    }
+    return MQTT_TOPIC_INVALID;
 }
 
-void publishMqtt(etherHeader *ether, socket *s, char strTopic[], char strData[])
+// Topic aliases (MQTT 5.0)
+// The first PUBLISH on a topic carries its name and the alias, later ones only the alias. The
+// broker forgets aliases with the connection.
+uint16_t getMqttTopicAlias(uint8_t topic)
 {
-    // MQTT "Header"
-    uint8_t buffer[MAX_BUFF_SIZE];
-    mqttHeader* mqtt = (mqttHeader*) buffer;
-    uint16_t payloadSize = 0;
-    char *strPtr;
-    char *payloadPtr;
+    return (mqttVersion == MQTT_VERSION_5 && topic < mqttTopicAliasMax) ? topic + 1 : 0;
+}
 
-    mqtt->headerFlags = 0x30;   // Connect Flag
+bool isMqttAliasKnown(uint8_t topic)
+{
+    return ((mqttAliasesSent | mqttAliasesPending) & (1 << topic)) != 0;
+}
 
-    // MQTT Publish Payload
-    mqttPublish *payload = (mqttPublish*) mqtt->lengthPayload;
+// Bytes of a PUBLISH taken by the topic name and, in MQTT 5.0, the properties
+uint16_t getMqttPublishTopicSize(uint8_t topic)
+{
+    if (mqttVersion != MQTT_VERSION_5)
+    {
+        return mqttTopics[topic].size;
+    }
+    if (getMqttTopicAlias(topic) == 0)
+    {
+        return mqttTopics[topic].size + 1;
+    }
+    return (isMqttAliasKnown(topic) ? sizeof(uint16_t) : mqttTopics[topic].size) + 4;
+}
 
-    strPtr = strTopic;  // Point to the start of topic to be copied
-    payloadPtr = payload->topic; // Point to the start of topic in payload
+// Builds a PUBLISH at start, packetId is only written for QoS 1 and 2
+// Returns the packet size, 0 if the topic is unknown or it does not fit in maxSize
+uint16_t putMqttPublish(uint8_t *start, uint16_t maxSize, uint8_t headerFlags, uint8_t topic,
+                        uint8_t data[], uint16_t dataLength, uint16_t packetId)
+{
+    mqttTopicEntry *entry;
+    uint16_t idLength = ((headerFlags & 0x06) != 0) ? sizeof(uint16_t) : 0;
+    uint16_t alias;
+    uint32_t remainingLength;
+    uint8_t *payloadPtr;
+
+    mqttPublishAlias = 0;
+    if (topic >= mqttTopicCount)
+    {
+        return 0;
+    }
+    entry = &mqttTopics[topic];
+    alias = getMqttTopicAlias(topic);
+    remainingLength = getMqttPublishTopicSize(topic) + idLength + dataLength;
+    if (sizeof(mqttHeader) + MQTT_MAX_LENGTH_BYTES + remainingLength > maxSize)
+    {
+        return 0;
+    }
 
-    // Topic name loop
-    while (*strPtr != NULL)
+    // MQTT Publish Payload, the topic is copied already encoded or left empty for a known alias
+    payloadPtr = putMqttHeader(start, headerFlags, remainingLength);
+    if (alias != 0 && isMqttAliasKnown(topic))
     {
-        payloadSize++;          // Increment the payload size
-        *payloadPtr = *strPtr;  // Copy the topic name
-        
-        // Move pointer
-        payloadPtr++;
-        strPtr++;
+        *payloadPtr++ = 0;
+        *payloadPtr++ = 0;
+    }
+    else
+    {
+        memcpy(payloadPtr, &mqttTopicBlob[entry->offset], entry->size);
+        payloadPtr += entry->size;
     }
 
-    payload->topicLength = htons(payloadSize); // Set the topic length
+    // Packet identifier, MSB first
+    if (idLength > 0)
+    {
+        *payloadPtr++ = packetId >> 8;
+        *payloadPtr++ = packetId & 0xFF;
+    }
 
-    strPtr = strData;  // Point to the start of message to be copied
-    // payloadPtr += 1; // Point to the start of message in payload
+    // MQTT 5.0 properties, only the topic alias
+    if (mqttVersion == MQTT_VERSION_5)
+    {
+        *payloadPtr++ = (alias != 0) ? 3 : 0;
+    }
+    if (alias != 0)
+    {
+        if (!isMqttAliasKnown(topic))
+        {
+            mqttPublishAlias = 1 << topic;
+        }
+        *payloadPtr++ = MQTT_PROP_TOPIC_ALIAS;
+        *payloadPtr++ = alias >> 8;
+        *payloadPtr++ = alias & 0xFF;
+    }
 
-    // Message loop
-    while (*strPtr != NULL)
+    // Already in the frame when built with reserveMqttPublishQos1, at most a byte off
+    if (payloadPtr != data)
     {
-        payloadSize++;          // Increment the payload size
-        *payloadPtr = *strPtr;  // Copy the message
-        
-        // Move pointer
-        payloadPtr++;
-        strPtr++;
+        memmove(payloadPtr, data, dataLength);
     }
-    // payloadSize += 1;
-  
+
     // adjust lengths
-    mqtt->msgLen = sizeof(mqttPublish) + payloadSize;
-    uint8_t dataSize = sizeof(mqttHeader) + mqtt->msgLen;
+    return (payloadPtr - start) + dataLength;
+}
+
+// Batched publishing
+// Between startMqttBatch and endMqttBatch PUBLISHes are written back to back into the
+// frame and leave as one TCP message, so a snapshot of several topics costs one segment
+// and one ACK instead of one per topic
+void startMqttBatch(void)
+{
+    mqttBatching = true;
+    mqttBatchSize = 0;
+    mqttBatchInflight = 0;
+}
+
+// Sends the batch, QoS 1 messages in it are resent later if TCP had no room
+bool endMqttBatch(etherHeader *ether, socket *s)
+{
+    uint8_t i;
+    bool ok = true;
+
+    mqttBatching = false;
+    if (mqttBatchSize > 0)
+    {
+        ok = commitMqttMessage(ether, s, mqttBatchSize);
+    }
+    for (i = 0; !ok && i < MQTT_INFLIGHT_WINDOW; i++)
+    {
+        if ((mqttBatchInflight & (1 << i)) != 0)
+        {
+            mqttInflight[i].sent = false;
+            mqttInflight[i].resendNeeded = true;
+        }
+    }
+    return ok;
+}
+
+// Where the next PUBLISH is built, after those already in the batch
+uint8_t* reserveMqttPublish(etherHeader *ether, socket *s, uint16_t *maxSize)
+{
+    uint8_t *start = reserveTcpMessage(ether, s, maxSize);
+
+    if (mqttBatching)
+    {
+        start += mqttBatchSize;
+        *maxSize -= mqttBatchSize;
+    }
+    return start;
+}
+
+// Sends a PUBLISH built at reserveMqttPublish, or only adds it to the batch
+bool commitMqttPublish(etherHeader *ether, socket *s, uint16_t size)
+{
+    mqttAliasesPending |= mqttPublishAlias;
+    mqttPublishAlias = 0;
+    if (mqttBatching)
+    {
+        mqttBatchSize += size;
+        return true;
+    }
+    return commitMqttMessage(ether, s, size);
+}
+
+void publishMqtt(etherHeader *ether, socket *s, uint8_t topic, char strData[])
+{
+    // MQTT "Header", built in place in the outbound frame
+    uint16_t maxSize;
+    uint8_t *start = reserveMqttPublish(ether, s, &maxSize);
+    uint16_t dataSize = putMqttPublish(start, maxSize, 0x30, topic, (uint8_t*)strData, strlen(strData), 0);   // Publish Flag
+
+    // Must fit in one frame
+    if (dataSize == 0)
+    {
+        return;
+    }
+
+    // Send the MQTT Publish message
+    commitMqttPublish(ether, s, dataSize);
+}
+
+// Next free packet identifier, never 0 and never one still awaiting its PUBACK
+uint16_t getMqttPacketId()
+{
+    uint8_t i;
+    bool inUse;
+
+    do
+    {
+        mqttPacketId++;
+        if (mqttPacketId == 0)
+        {
+            mqttPacketId = 1;
+        }
+        inUse = false;
+        for (i = 0; i < MQTT_INFLIGHT_WINDOW; i++)
+        {
+            inUse |= (mqttInflight[i].packetId == mqttPacketId);
+        }
+    } while (inUse);
+
+    return mqttPacketId;
+}
+
+// QoS 1 messages sent on this connection and not yet acknowledged
+uint8_t getMqttOutstandingCount()
+{
+    uint8_t i, count = 0;
+
+    for (i = 0; i < MQTT_INFLIGHT_WINDOW; i++)
+    {
+        if (mqttInflight[i].packetId != 0 && !mqttInflight[i].resendNeeded)
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+// QoS 1 publish of a string, see publishMqttQos1Data
+uint16_t publishMqttQos1(etherHeader *ether, socket *s, uint8_t topic, char strData[],
+                         _mqttCompleteCallback callback, void *context)
+{
+    return publishMqttQos1Data(ether, s, topic, (uint8_t*)strData, strlen(strData), callback, context);
+}
+
+// Free in-flight slots a lane may still take, telemetry leaves the last MQTT_ALARM_RESERVED to alarms
+uint8_t getMqttWindowRoom(uint8_t lane)
+{
+    uint8_t used = getMqttInflightCount();
+
+    if (lane == MQTT_LANE_ALARM)
+    {
+        return MQTT_INFLIGHT_WINDOW - used;
+    }
+    return (used < MQTT_TELEMETRY_WINDOW) ? MQTT_TELEMETRY_WINDOW - used : 0;
+}
+
+// Queues a QoS 1 PUBLISH in the window and sends it unless something ahead of it in its
+// lane or a higher one is still waiting
+uint16_t queueMqttPublish(etherHeader *ether, socket *s, uint8_t topic, uint8_t data[], uint16_t dataLength,
+                          uint8_t lane, bool retain, _mqttCompleteCallback callback, void *context)
+{
+    uint16_t maxSize;
+    uint8_t *start = reserveMqttPublish(ether, s, &maxSize);
+    mqttInflightMessage *msg = NULL;
+    bool waiting = (getMqttOutstandingCount() >= mqttReceiveMax);
+    uint8_t i;
+
+    // Older messages still waiting to go out are sent first, the broker's receive maximum
+    // holds back the rest
+    for (i = 0; i < MQTT_INFLIGHT_WINDOW; i++)
+    {
+        waiting |= (mqttInflight[i].packetId != 0 && mqttInflight[i].resendNeeded && mqttInflight[i].lane >= lane);
+    }
+    for (i = 0; i < MQTT_INFLIGHT_WINDOW && msg == NULL; i++)
+    {
+        if (mqttInflight[i].packetId == 0)
+        {
+            msg = &mqttInflight[i];
+        }
+    }
+    if (msg == NULL || getMqttWindowRoom(lane) == 0)
+    {
+        return 0;
+    }
+
+    if (maxSize > MQTT_INFLIGHT_PACKET_SIZE)
+    {
+        maxSize = MQTT_INFLIGHT_PACKET_SIZE;
+    }
+    msg->size = putMqttPublish(start, maxSize, 0x32 | retain, topic, data, dataLength, getMqttPacketId());   // Publish, QoS 1
+    if (msg->size == 0)
+    {
+        return 0;
+    }
+    memcpy(msg->packet, start, msg->size);
+    msg->topic = topic;
+    msg->payloadOffset = msg->size - dataLength;
+    msg->packetId = mqttPacketId;
+    msg->order = mqttPublishOrder++;
+    msg->lane = lane;
+    msg->retain = retain;
+    msg->callback = callback;
+    msg->context = context;
+
+    // Not connected or no room in TCP, goes out from sendMqttPendingMessages instead
+    msg->sent = mqttConnected && !waiting && commitMqttPublish(ether, s, msg->size);
+    msg->resendNeeded = !msg->sent;
+    if (msg->sent && mqttBatching)
+    {
+        mqttBatchInflight |= 1 << (msg - mqttInflight);
+    }
+
+    return msg->packetId;
+}
+
+// QoS 1 publish
+// The packet is kept until the broker's PUBACK, then callback runs with context. Up to
+// MQTT_TELEMETRY_WINDOW messages can be outstanding, so publishing does not wait for each
+// PUBACK. Returns the packet identifier, 0 if the window is full or the message too large.
+uint16_t publishMqttQos1Data(etherHeader *ether, socket *s, uint8_t topic, uint8_t data[], uint16_t dataLength,
+                             _mqttCompleteCallback callback, void *context)
+{
+    return queueMqttPublish(ether, s, topic, data, dataLength, MQTT_LANE_TELEMETRY, false, callback, context);
+}
+
+// Alarm publish, QoS 1 and retained so a client subscribing later sees the alarm state
+// Goes out ahead of any telemetry waiting in the window, same return as publishMqttQos1Data
+uint16_t publishMqttAlarm(etherHeader *ether, socket *s, uint8_t topic, char strData[],
+                          _mqttCompleteCallback callback, void *context)
+{
+    return queueMqttPublish(ether, s, topic, (uint8_t*)strData, strlen(strData), MQTT_LANE_ALARM, true,
+                            callback, context);
+}
+
+// Offset of the payload in a QoS 1 PUBLISH no larger than MQTT_INFLIGHT_PACKET_SIZE
+// Header, 2 byte Remaining Length, encoded topic, packet identifier, MQTT 5.0 properties.
+// Shorter packets use a 1 byte length and putMqttPublish moves the payload down by one.
+uint16_t getMqttQos1PayloadOffset(uint8_t topic)
+{
+    uint16_t topicSize = getMqttPublishTopicSize(topic);
 
-    // Send the MQTT Connect message
-    sendTcpMessage(ether, s, PSH | ACK, (uint8_t *)mqtt, dataSize);
+    return sizeof(mqttHeader) + 2 + topicSize + sizeof(uint16_t);
 }
 
-void subscribeMqtt(etherHeader *ether, socket *s, char strTopic[])
+// Zero-copy QoS 1 publish, step 1
+// Returns where the payload goes in the outbound frame and its room in maxSize, NULL if the
+// window is full. Encoders write there directly and commitMqttPublishQos1 builds the rest.
+uint8_t* reserveMqttPublishQos1(etherHeader *ether, socket *s, uint8_t topic, uint16_t *maxSize)
 {
-    // MQTT "Header"
-    uint8_t buffer[MAX_BUFF_SIZE];
-    mqttSubscribeHeader* mqtt = (mqttSubscribeHeader*) buffer;
-    uint16_t payloadSize = 0;
-    char *strPtr;
-    char *payloadPtr;
+    uint16_t frameSize;
+    uint8_t *start = reserveMqttPublish(ether, s, &frameSize);
+    uint16_t offset;
 
-    mqtt->headerFlags = 0x82;   // Connect Flag
-    mqtt->MessageIdentifier = htons(10);
+    *maxSize = 0;
+    if (topic >= mqttTopicCount || getMqttWindowRoom(MQTT_LANE_TELEMETRY) == 0)
+    {
+        return NULL;
+    }
+    if (frameSize > MQTT_INFLIGHT_PACKET_SIZE)
+    {
+        frameSize = MQTT_INFLIGHT_PACKET_SIZE;
+    }
+    // putMqttPublish leaves room for the longest Remaining Length
+    offset = getMqttQos1PayloadOffset(topic);
+    if (offset + MQTT_MAX_LENGTH_BYTES - 2 >= frameSize)
+    {
+        return NULL;
+    }
+    *maxSize = frameSize - offset - (MQTT_MAX_LENGTH_BYTES - 2);
+    return start + offset;
+}
 
-    // MQTT Publish Payload
-    mqttSubscribe *payload = (mqttSubscribe*) mqtt->lengthPayload;
+// Zero-copy QoS 1 publish, step 2
+// Same as publishMqttQos1Data for the dataLength bytes written at reserveMqttPublishQos1
+uint16_t commitMqttPublishQos1(etherHeader *ether, socket *s, uint8_t topic, uint16_t dataLength,
+                               _mqttCompleteCallback callback, void *context)
+{
+    uint16_t maxSize;
+    uint8_t *start = reserveMqttPublish(ether, s, &maxSize);
+
+    if (topic >= mqttTopicCount)
+    {
+        return 0;
+    }
+    return publishMqttQos1Data(ether, s, topic, start + getMqttQos1PayloadOffset(topic), dataLength, callback, context);
+}
+
+// Number of QoS 1 messages still awaiting PUBACK
+uint8_t getMqttInflightCount()
+{
+    uint8_t i, count = 0;
+
+    for (i = 0; i < MQTT_INFLIGHT_WINDOW; i++)
+    {
+        if (mqttInflight[i].packetId != 0)
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+// Sends what the broker still has to see, must be called with a free frame
+// Alarms go first, then each lane in its original order, those sent on an earlier connection
+// with the DUP flag. They are built again since the topic aliases they used may be gone.
+void sendMqttPendingMessages(etherHeader *ether, socket *s)
+{
+    uint8_t i, best;
+    uint16_t maxSize, size;
+    uint8_t *start;
+    mqttInflightMessage *msg;
+
+    processMqttTimers();
+
+    // Backoff expired, open the connection again, to another broker if this one failed
+    if (mqttReconnectNeeded)
+    {
+        mqttReconnectNeeded = false;
+        startMqttConnection(s);
+    }
+
+    // The broker stopped answering, TCP may not notice for a long time
+    if (mqttLost)
+    {
+        mqttLost = false;
+        if (getTcpState(s) != TCP_CLOSED)
+        {
+            sendTcpMessage(ether, s, RST | ACK, NULL, 0);
+            closeTcpSocket(s);
+        }
+        return;
+    }
+
+    if (!mqttConnected)
+    {
+        return;
+    }
+
+    // On a backup long enough and a better broker may be back, the broker closes the
+    // connection and the reconnect goes to the better one
+    best = findMqttBroker();
+    if (!mqttFailingBack && getMqttBroker(mqttCurrentBroker) != NULL && best != MQTT_BROKER_INVALID
+        && mqttBrokers[best].priority < mqttBrokers[mqttCurrentBroker].priority
+        && getUptime() - mqttConnectedAt >= MQTT_FAILBACK_S)
+    {
+        mqttFailingBack = true;
+        sendMqttDisconnect(ether, s);
+        mqttResponseTimer = MQTT_RESPONSE_TIMEOUT_S;   // Reset if it does not
+        return;
+    }
+
+    // Nothing went out for a keepalive period
+    if (mqttPingNeeded)
+    {
+        putMqttHeader(reserveTcpMessage(ether, s, NULL), 0xC0, 0);     // PINGREQ
+        if (commitMqttMessage(ether, s, 2))
+        {
+            mqttPingNeeded = false;
+            mqttResponseTimer = MQTT_RESPONSE_TIMEOUT_S;
+        }
+    }
+    sendMqttSubscriptions(ether, s);
+    while (true)
+    {
+        msg = NULL;
+        for (i = 0; i < MQTT_INFLIGHT_WINDOW; i++)
+        {
+            if (mqttInflight[i].packetId != 0 && mqttInflight[i].resendNeeded
+                && (msg == NULL || mqttInflight[i].lane > msg->lane
+                    || (mqttInflight[i].lane == msg->lane && (int16_t)(mqttInflight[i].order - msg->order) < 0)))
+            {
+                msg = &mqttInflight[i];
+            }
+        }
+        if (msg == NULL || getMqttOutstandingCount() >= mqttReceiveMax)
+        {
+            break;
+        }
+        start = reserveTcpMessage(ether, s, &maxSize);
+        size = putMqttPublish(start, maxSize, (msg->sent ? 0x3A : 0x32) | msg->retain, msg->topic,     // DUP
+                              &msg->packet[msg->payloadOffset], msg->size - msg->payloadOffset, msg->packetId);
+        if (size == 0 || !commitMqttPublish(ether, s, size))
+        {
+            break;
+        }
+        msg->sent = true;
+        msg->resendNeeded = false;
+    }
+}
+
+// Builds one SUBSCRIBE (QoS 0) or UNSUBSCRIBE with every filter waiting for it, as many as
+// fit in a frame, all under one packet ID
+// Returns false if nothing was waiting or TCP had no room
+bool sendMqttSubscribe(etherHeader *ether, socket *s, bool subscribe)
+{
+    // MQTT "Header", built in place in the outbound frame
+    uint16_t maxSize;
+    uint8_t *start = reserveTcpMessage(ether, s, &maxSize);
+    uint32_t remainingLength = sizeof(mqttSubscribeHeader) + (mqttVersion == MQTT_VERSION_5);   // No properties
+    uint32_t filters = 0;
+    uint16_t filterLength, packetId;
+    uint8_t i, *p;
+    mqttSubscription *sub;
+
+    // Filter, 16-bit length first, and the requested QoS only in SUBSCRIBE
+    for (i = 0; i < MQTT_MAX_SUBSCRIPTIONS; i++)
+    {
+        sub = &mqttSubscriptions[i];
+        if (sub->inUse && (subscribe ? sub->subscribeNeeded : sub->unsubscribeNeeded))
+        {
+            filterLength = sizeof(uint16_t) + strlen(sub->filter) + subscribe;
+            if (sizeof(mqttHeader) + MQTT_MAX_LENGTH_BYTES + remainingLength + filterLength > maxSize)
+            {
+                break;
+            }
+            remainingLength += filterLength;
+            filters |= 1 << i;
+        }
+    }
+    if (filters == 0)
+    {
+        return false;
+    }
+
+    packetId = getMqttPacketId();
+    mqttSubscribeHeader *mqtt = (mqttSubscribeHeader*) putMqttHeader(start, subscribe ? 0x82 : 0xA2, remainingLength);
+    mqtt->MessageIdentifier = htons(packetId);
+
+    // SUBACK return codes come back in this order
+    // Built through a byte cursor, the filter is variable length so no struct fits it
+    p = mqtt->lengthPayload;
+    if (mqttVersion == MQTT_VERSION_5)
+    {
+        *p++ = 0;
+    }
+    for (i = 0; i < MQTT_MAX_SUBSCRIPTIONS; i++)
+    {
+        if ((filters & (1 << i)) != 0)
+        {
+            filterLength = strlen(mqttSubscriptions[i].filter);
+            *p++ = filterLength >> 8;
+            *p++ = filterLength & 0xFF;
+            memcpy(p, mqttSubscriptions[i].filter, filterLength);
+            p += filterLength;
+            if (subscribe)
+            {
+                *p++ = 0;
+            }
+        }
+    }
+
+    if (!commitMqttMessage(ether, s, p - start))
+    {
+        return false;
+    }
+
+    for (i = 0; i < MQTT_MAX_SUBSCRIPTIONS; i++)
+    {
+        sub = &mqttSubscriptions[i];
+        if ((filters & (1 << i)) != 0 && subscribe)
+        {
+            sub->packetId = packetId;
+            sub->subscribeNeeded = false;
+        }
+        else if ((filters & (1 << i)) != 0)
+        {
+            sub->inUse = false;
+        }
+    }
+    return true;
+}
+
+// Sends the SUBSCRIBEs and UNSUBSCRIBEs queued by subscribeMqtt and unsubscribeMqtt
+// Usually one packet of each, after a reconnect all subscriptions cost one round trip
+void sendMqttSubscriptions(etherHeader *ether, socket *s)
+{
+    while (sendMqttSubscribe(ether, s, false));
+    while (sendMqttSubscribe(ether, s, true));
+}
+
+// Finds the node for one filter level among siblings
+uint8_t findMqttTrieNode(uint8_t node, char level[], uint8_t levelLength)
+{
+    while (node != MQTT_TRIE_NONE)
+    {
+        if (mqttTrie[node].levelLength == levelLength && memcmp(mqttTrie[node].level, level, levelLength) == 0)
+        {
+            return node;
+        }
+        node = mqttTrie[node].sibling;
+    }
+    return MQTT_TRIE_NONE;
+}
 
-    strPtr = strTopic;  // Point to the start of topic to be copied
-    payloadPtr = payload->topic; // Point to the start of topic in payload
+// A filter is valid when + and # fill a whole level and # is the last one
+bool isMqttFilterValid(char strFilter[])
+{
+    uint16_t start = 0, end;
 
-    // Topic name loop
-    while (*strPtr)
-       {
-           payloadSize++;          // Increment the payload size
-           *payloadPtr = *strPtr;  // Copy the topic name
-           // Move pointer
-           payloadPtr++;
-           strPtr++;
+    if (strFilter[0] == 0 || strlen(strFilter) >= MQTT_FILTER_SIZE)
+    {
+        return false;
+    }
+    while (true)
+    {
+        for (end = start; strFilter[end] != 0 && strFilter[end] != '/'; end++)
+        {
+            if ((strFilter[end] == '+' || strFilter[end] == '#') && (end != start || (strFilter[end + 1] != 0 && strFilter[end + 1] != '/')))
+            {
+                return false;
+            }
         }
+        if (end - start >= MQTT_LEVEL_SIZE || (strFilter[start] == '#' && strFilter[end] != 0))
+        {
+            return false;
+        }
+        if (strFilter[end] == 0)
+        {
+            return true;
+        }
+        start = end + 1;
+    }
+}
 
-    *payloadPtr = 0x0; //assigns the value 0 to QoS
+// Drops nodes that end no filter and lead to none, returns the new first sibling
+uint8_t pruneMqttTrie(uint8_t node)
+{
+    uint8_t next;
 
-     // adjust lengths
-    payload->topicLength = htons(payloadSize);// Set the topic length
-    mqtt->msgLen = (sizeof(mqttSubscribeHeader) + payloadSize+1); //add 1 to payload when not using pointer
-    uint8_t dataSize = (sizeof(mqttSubscribe) + mqtt->msgLen);//size of pointer is 8bytes
-    //topicLength = payloadSize;  // save topic length calculating offset.
-    dataSize = dataSize - 2;
-    // Send the MQTT Connect message
-    sendTcpMessage(ether, s, PSH | ACK, (uint8_t *)mqtt, dataSize);
+    if (node == MQTT_TRIE_NONE)
+    {
+        return MQTT_TRIE_NONE;
+    }
+    next = pruneMqttTrie(mqttTrie[node].sibling);
+    mqttTrie[node].child = pruneMqttTrie(mqttTrie[node].child);
+    if (mqttTrie[node].child == MQTT_TRIE_NONE && mqttTrie[node].subscription == MQTT_SUBSCRIPTION_INVALID)
+    {
+        mqttTrie[node].inUse = false;
+        return next;
+    }
+    mqttTrie[node].sibling = next;
+    return node;
 }
 
-void unsubscribeMqtt(etherHeader *ether, socket *s, char strTopic[])
+// Adds the levels of a valid filter, returns the node it ends at
+uint8_t insertMqttFilter(char strFilter[])
 {
-    // MQTT "Header"
-    uint8_t buffer[MAX_BUFF_SIZE];
-    mqttSubscribeHeader* mqtt = (mqttSubscribeHeader*) buffer;
-    uint16_t payloadSize = 0;
-    char *strPtr;
-    char *payloadPtr;
+    uint8_t *link = &mqttTrieRoot;
+    uint8_t node = MQTT_TRIE_NONE, i;
+    uint16_t start = 0, end;
+
+    while (true)
+    {
+        for (end = start; strFilter[end] != 0 && strFilter[end] != '/'; end++);
+        node = findMqttTrieNode(*link, &strFilter[start], end - start);
+        if (node == MQTT_TRIE_NONE)
+        {
+            for (i = 0; i < MQTT_TRIE_NODES && mqttTrie[i].inUse; i++);
+            if (i == MQTT_TRIE_NODES)
+            {
+                // Out of nodes, the levels added so far are pruned again
+                mqttTrieRoot = pruneMqttTrie(mqttTrieRoot);
+                return MQTT_TRIE_NONE;
+            }
+            node = i;
+            memcpy(mqttTrie[node].level, &strFilter[start], end - start);
+            mqttTrie[node].levelLength = end - start;
+            mqttTrie[node].child = MQTT_TRIE_NONE;
+            mqttTrie[node].sibling = *link;
+            mqttTrie[node].subscription = MQTT_SUBSCRIPTION_INVALID;
+            mqttTrie[node].inUse = true;
+            *link = node;
+        }
+        if (strFilter[end] == 0)
+        {
+            return node;
+        }
+        link = &mqttTrie[node].child;
+        start = end + 1;
+    }
+}
 
-    mqtt->headerFlags = 0xA2;   // Unsubscribe
-    mqtt->MessageIdentifier = htons(11);
+// Finds the node a filter ends at
+uint8_t findMqttFilter(char strFilter[])
+{
+    uint8_t node = mqttTrieRoot;
+    uint16_t start = 0, end;
 
-    // MQTT Publish Payload
-    mqttSubscribe *payload = (mqttSubscribe*) mqtt->lengthPayload;
+    while (true)
+    {
+        for (end = start; strFilter[end] != 0 && strFilter[end] != '/'; end++);
+        node = findMqttTrieNode(node, &strFilter[start], end - start);
+        if (node == MQTT_TRIE_NONE || strFilter[end] == 0)
+        {
+            return node;
+        }
+        node = mqttTrie[node].child;
+        start = end + 1;
+    }
+}
 
-    strPtr = strTopic;  // Point to the start of topic to be copied
-    payloadPtr = payload->topic; // Point to the start of topic in payload
+// Subscribes to a filter, + matches one level and # the rest of the topic
+// Returns a handle for isMqttSubAcked or MQTT_SUBSCRIPTION_INVALID when the filter is invalid
+// or the table is full. The SUBSCRIBE goes out from sendMqttPendingMessages and again after
+// each CONNACK, subscribing to the same filter again replaces its handler.
+uint8_t subscribeMqtt(char strFilter[], _mqttMessageCallback callback, void *context)
+{
+    uint8_t i, node;
+    mqttSubscription *sub;
 
-    // Topic name loop
-    while (*strPtr)
-       {
-           payloadSize++;          // Increment the payload size
-           *payloadPtr = *strPtr;  // Copy the topic name
-           // Move pointer
-           payloadPtr++;
-           strPtr++;
+    if (!isMqttFilterValid(strFilter))
+    {
+        return MQTT_SUBSCRIPTION_INVALID;
+    }
+    for (i = 0; i < MQTT_MAX_SUBSCRIPTIONS; i++)
+    {
+        if (mqttSubscriptions[i].inUse && strcmp(mqttSubscriptions[i].filter, strFilter) == 0)
+        {
+            break;
         }
+    }
+    if (i == MQTT_MAX_SUBSCRIPTIONS)
+    {
+        for (i = 0; i < MQTT_MAX_SUBSCRIPTIONS && mqttSubscriptions[i].inUse; i++);
+        if (i == MQTT_MAX_SUBSCRIPTIONS)
+        {
+            return MQTT_SUBSCRIPTION_INVALID;
+        }
+    }
+    node = insertMqttFilter(strFilter);
+    if (node == MQTT_TRIE_NONE)
+    {
+        return MQTT_SUBSCRIPTION_INVALID;
+    }
 
-    //*payloadPtr = 0x0; //assigns the value 0 to QoS.. Not needed for unsubscribed
+    sub = &mqttSubscriptions[i];
+    if (!sub->inUse || sub->unsubscribeNeeded)
+    {
+        strcpy(sub->filter, strFilter);
+        sub->packetId = 0;
+        sub->granted = false;
+        sub->subscribeNeeded = true;
+        sub->unsubscribeNeeded = false;
+        sub->inUse = true;
+    }
+    sub->callback = callback;
+    sub->context = context;
+    mqttTrie[node].subscription = i;
 
-     // adjust ldataengths
-    payload->topicLength = htons(payloadSize);// Set the topic length
-    mqtt->msgLen = (sizeof(mqttSubscribeHeader) + payloadSize); //
-    uint8_t dataSize = (sizeof(mqttSubscribe) + mqtt->msgLen);//size of pointer is 8bytes
-    dataSize = dataSize - 1;
-    // Send the MQTT Connect message
-    sendTcpMessage(ether, s, PSH | ACK, (uint8_t *)mqtt, dataSize);
+    return i;
 }
 
-bool processPubMessage(etherHeader *ether, socket *s, char topicData[])
+// Stops delivery at once, the UNSUBSCRIBE goes out from sendMqttPendingMessages
+// Returns false if the filter was not subscribed
+bool unsubscribeMqtt(char strFilter[])
 {
-    tcpHeader* tcp = getTcpHeaderPtr(ether);
-    uint8_t *payloadPtr = tcp->data;
-    bool ok = false;
+    uint8_t node = findMqttFilter(strFilter);
+    mqttSubscription *sub;
 
-    // Get the header flags, check if publish
-    if (*payloadPtr == 0x30)
+    if (node == MQTT_TRIE_NONE || mqttTrie[node].subscription == MQTT_SUBSCRIPTION_INVALID)
     {
-        ok = true;
+        return false;
+    }
+    sub = &mqttSubscriptions[mqttTrie[node].subscription];
+    mqttTrie[node].subscription = MQTT_SUBSCRIPTION_INVALID;
+    mqttTrieRoot = pruneMqttTrie(mqttTrieRoot);
+
+    // The broker only has to be told if it may have seen the SUBSCRIBE, a persistent
+    // session keeps it while we are offline
+    sub->unsubscribeNeeded = (mqttConnected || !mqttCleanSession) && !sub->subscribeNeeded;
+    sub->subscribeNeeded = false;
+    sub->granted = false;
+    sub->inUse = sub->unsubscribeNeeded;
+    return true;
+}
 
-        uint8_t i = 0;
-        uint8_t dataLen = 0;
+// Matches the topic level starting at start against the sibling nodes from node and,
+// through their children, the levels after it
+uint32_t matchMqttTrie(uint8_t node, char topic[], uint16_t topicLength, uint16_t start, bool wildcards)
+{
+    uint32_t matches = 0;
+    uint16_t end;
+    uint8_t child;
+    mqttTrieNode *n;
 
-        // Move ptr to message length
-        payloadPtr += 1;
+    for (end = start; end < topicLength && topic[end] != '/'; end++);
 
-        // Increment ack number by TCP Payload size
-        s->acknowledgementNumber += (2 + *payloadPtr);
+    for (; node != MQTT_TRIE_NONE; node = n->sibling)
+    {
+        n = &mqttTrie[node];
+        if (n->level[0] == '#' && n->levelLength == 1)
+        {
+            if (wildcards && n->subscription != MQTT_SUBSCRIPTION_INVALID)
+            {
+                matches |= 1UL << n->subscription;
+            }
+        }
+        else if ((wildcards && n->level[0] == '+' && n->levelLength == 1)
+                 || (n->levelLength == end - start && memcmp(n->level, &topic[start], end - start) == 0))
+        {
+            if (end < topicLength)
+            {
+                matches |= matchMqttTrie(n->child, topic, topicLength, end + 1, true);
+            }
+            else
+            {
+                if (n->subscription != MQTT_SUBSCRIPTION_INVALID)
+                {
+                    matches |= 1UL << n->subscription;
+                }
+
+                // "a/#" also matches "a"
+                child = findMqttTrieNode(n->child, "#", 1);
+                if (child != MQTT_TRIE_NONE && mqttTrie[child].subscription != MQTT_SUBSCRIPTION_INVALID)
+                {
+                    matches |= 1UL << mqttTrie[child].subscription;
+                }
+            }
+        }
+    }
+    return matches;
+}
 
-        // Get data length from message length and previously recorded topic length
-        dataLen = *payloadPtr - subbedTopicLength - 2;
+// Returns a bit per subscription whose filter matches the topic
+// Topics starting with $ are not matched by a leading wildcard
+uint32_t matchMqttTopic(char topic[], uint16_t topicLength)
+{
+    return matchMqttTrie(mqttTrieRoot, topic, topicLength, 0, topicLength == 0 || topic[0] != '$');
+}
+
+// Size of one MQTT 5.0 property value, 0 for an unknown identifier or a value cut short
+uint16_t getMqttPropertySize(uint8_t id, uint8_t data[], uint16_t size)
+{
+    uint32_t value;
+    uint16_t length;
+    uint8_t lengthBytes;
+
+    switch (id)
+    {
+        // Byte
+        case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A:
+            return 1;
+        // Two byte integer
+        case 0x13: case 0x21: case 0x22: case 0x23:
+            return 2;
+        // Four byte integer
+        case 0x02: case 0x11: case 0x18: case 0x27:
+            return 4;
+        // Variable byte integer
+        case 0x0B:
+            lengthBytes = decodeMqttLength(data, size, &value);
+            return (lengthBytes == MQTT_LENGTH_INVALID) ? 0 : lengthBytes;
+        // String or binary data
+        case 0x03: case 0x08: case 0x09: case 0x12: case 0x15: case 0x16: case 0x1A: case 0x1C: case 0x1F:
+            return (size >= 2) ? 2 + ((data[0] << 8) | data[1]) : 0;
+        // String pair
+        case 0x26:
+            if (size < 2)
+            {
+                return 0;
+            }
+            length = 2 + ((data[0] << 8) | data[1]);
+            return (size >= length + 2) ? length + 2 + ((data[length] << 8) | data[length + 1]) : 0;
+        default:
+            return 0;
+    }
+}
 
-        // Point to the start of data (going over message len bits and topic len)
-        payloadPtr += 3 + subbedTopicLength;
+// Reads MQTT 5.0 properties, a length then identifier and value pairs, and keeps the limits
+// the broker sets for the connection
+// Returns the bytes used, MQTT_PROPERTIES_INVALID if malformed
+uint16_t processMqttProperties(uint8_t data[], uint16_t size)
+{
+    uint32_t length;
+    uint8_t lengthBytes = decodeMqttLength(data, size, &length);
+    uint16_t i, end, valueSize, value;
+    uint8_t id;
 
-        // Store the data to the passed in string
-        for (i = 0; i < dataLen; i++)
+    // A complete length never has more bytes than size, so the subtraction cannot wrap
+    if (lengthBytes == 0 || lengthBytes == MQTT_LENGTH_INVALID || length > (uint32_t)size - lengthBytes)
+    {
+        return MQTT_PROPERTIES_INVALID;
+    }
+    end = lengthBytes + length;
+    for (i = lengthBytes; i < end; i += valueSize)
+    {
+        id = data[i++];
+        valueSize = getMqttPropertySize(id, &data[i], end - i);
+        if (valueSize == 0 || valueSize > end - i)
         {
-            topicData[i] = *payloadPtr;
-            payloadPtr++;
+            return MQTT_PROPERTIES_INVALID;
         }
+        if (id == MQTT_PROP_RECEIVE_MAXIMUM || id == MQTT_PROP_TOPIC_ALIAS_MAX || id == MQTT_PROP_SERVER_KEEP_ALIVE)
+        {
+            value = (data[i] << 8) | data[i + 1];
+            if (id == MQTT_PROP_TOPIC_ALIAS_MAX)
+            {
+                mqttTopicAliasMax = value;
+            }
+            // Replaces the keep alive we asked for in CONNECT
+            else if (id == MQTT_PROP_SERVER_KEEP_ALIVE)
+            {
+                mqttKeepAlive = value;
+            }
+            else if (value > 0)
+            {
+                mqttReceiveMax = value;
+            }
+        }
+    }
+    return end;
+}
 
-        // Send ack for the publish message to keep receiving messages
-        sendAck();
+// Handles a PUBLISH from the broker, each matching subscription gets a copy
+void processMqttPublish(uint8_t headerFlags, uint8_t body[], uint16_t length)
+{
+    uint16_t topicLength;
+    uint16_t offset, size;
+    uint32_t matches;
+    uint8_t i;
+    mqttSubscription *sub;
+
+    if (length < 2)
+    {
+        return;
     }
-    else
+    topicLength = (body[0] << 8) | body[1];
+    offset = 2 + topicLength;
+
+    // QoS 1 and 2 carry a packet identifier after the topic
+    if ((headerFlags & 0x06) != 0)
+    {
+        offset += 2;
+    }
+    if (offset > length)
     {
-        ok = true;
+        return;
     }
 
-    return ok;
+    // MQTT 5.0 properties before the payload, no topic alias since we allow none
+    if (mqttVersion == MQTT_VERSION_5)
+    {
+        size = processMqttProperties(&body[offset], length - offset);
+        if (size == MQTT_PROPERTIES_INVALID)
+        {
+            return;
+        }
+        offset += size;
+    }
+
+    matches = matchMqttTopic((char*)&body[2], topicLength);
+    for (i = 0; matches != 0 && i < MQTT_MAX_SUBSCRIPTIONS; i++)
+    {
+        sub = &mqttSubscriptions[i];
+        if ((matches & (1UL << i)) != 0 && sub->callback != NULL)
+        {
+            sub->callback((char*)&body[2], topicLength, &body[offset], length - offset, sub->context);
+        }
+    }
 }
 
-void checkMqttConAck(etherHeader *ether, socket *s)
+// Acts on one complete packet
+// body may still be in the received frame, nothing here may build a message
+void processMqttPacket(uint8_t headerFlags, uint8_t body[], uint16_t length)
 {
-    tcpHeader* tcp = getTcpHeaderPtr(ether);
-    uint8_t headerFlags = tcp->data[0];
+    uint8_t i, reason;
+    uint16_t packetId, offset;
+    mqttInflightMessage *msg;
+    mqttSubscription *sub;
 
-    if (headerFlags == 0x20)
+    switch (headerFlags >> 4)
     {
-        // updateTcpSeqAck(ether, s);
-        s->acknowledgementNumber += 4;
-        sendAck();
-        mqttConnected = true;
+        case MQTT_CONNACK:
+            // Return code 0 is accepted, a refused client is closed by the broker and retries later
+            mqttConnected = (length >= 2 && body[1] == 0);
+            mqttSessionPresent = mqttConnected && !mqttCleanSession && (body[0] & 0x01) != 0;
+            mqttReasonCode = (length >= 2) ? body[1] : 0;
+            mqttResponseTimer = 0;
+            mqttIdle = 0;
+
+            // Limits of this connection, MQTT 5.0 brokers send them as properties
+            mqttReceiveMax = 0xFFFF;
+            mqttTopicAliasMax = 0;
+            mqttKeepAlive = MQTT_KEEPALIVE_S;
+            mqttAliasesSent = 0;
+            mqttAliasesPending = 0;
+            if (mqttConnected && mqttVersion == MQTT_VERSION_5
+                && processMqttProperties(&body[2], length - 2) == MQTT_PROPERTIES_INVALID)
+            {
+                mqttReceiveMax = 0xFFFF;
+                mqttTopicAliasMax = 0;
+                mqttKeepAlive = MQTT_KEEPALIVE_S;
+            }
+            if (mqttConnected)
+            {
+                mqttReconnectAttempts = 0;
+                mqttConnectedAt = getUptime();
+                if (getMqttBroker(mqttCurrentBroker) != NULL)
+                {
+                    mqttBrokers[mqttCurrentBroker].failures = 0;
+                }
+            }
+
+            // Anything still unacknowledged is sent again on the new connection
+            for (i = 0; mqttConnected && i < MQTT_INFLIGHT_WINDOW; i++)
+            {
+                mqttInflight[i].resendNeeded = (mqttInflight[i].packetId != 0);
+            }
+
+            // A new session starts without subscriptions, a kept one still has those granted
+            // before and misses only the ones that were never acknowledged
+            for (i = 0; mqttConnected && i < MQTT_MAX_SUBSCRIPTIONS; i++)
+            {
+                sub = &mqttSubscriptions[i];
+                if (mqttSessionPresent)
+                {
+                    sub->subscribeNeeded = sub->inUse && !sub->unsubscribeNeeded && !sub->granted;
+                }
+                else
+                {
+                    sub->subscribeNeeded = sub->inUse && !sub->unsubscribeNeeded;
+                    sub->inUse = sub->subscribeNeeded;
+                    sub->granted = false;
+                }
+            }
+            break;
+        case MQTT_PUBLISH:
+            processMqttPublish(headerFlags, body, length);
+            break;
+        case MQTT_PINGRESP:
+            mqttResponseTimer = 0;
+            break;
+        case MQTT_PUBACK:
+            // MQTT 5.0 may add a reason code, 0x80 and up means the broker refused the message
+            packetId = (length >= 2) ? (body[0] << 8) | body[1] : 0;
+            reason = (length >= 3) ? body[2] : 0;
+            for (i = 0; packetId != 0 && i < MQTT_INFLIGHT_WINDOW; i++)
+            {
+                msg = &mqttInflight[i];
+                if (msg->packetId == packetId)
+                {
+                    msg->packetId = 0;
+                    mqttReasonCode = reason;
+                    if (msg->callback != NULL && reason < 0x80)
+                    {
+                        msg->callback(packetId, msg->context);
+                    }
+                }
+            }
+            break;
+        case MQTT_SUBACK:
+            // One return code per filter in the order they were sent, 0x80 and up is refused
+            // MQTT 5.0 puts properties before them
+            packetId = (length >= 3) ? (body[0] << 8) | body[1] : 0;
+            offset = 2;
+            if (packetId != 0 && mqttVersion == MQTT_VERSION_5)
+            {
+                offset = processMqttProperties(&body[2], length - 2);
+                offset = (offset == MQTT_PROPERTIES_INVALID) ? length : offset + 2;
+            }
+            for (i = 0; packetId != 0 && i < MQTT_MAX_SUBSCRIPTIONS && offset < length; i++)
+            {
+                sub = &mqttSubscriptions[i];
+                if (sub->inUse && sub->packetId == packetId)
+                {
+                    sub->packetId = 0;
+                    mqttReasonCode = body[offset++];
+                    sub->granted = (mqttReasonCode < 0x80);
+                }
+            }
+            break;
+        case MQTT_DISCONNECT:
+            // MQTT 5.0 only, the broker says why before it closes the connection
+            mqttConnected = false;
+            mqttReasonCode = (length >= 1) ? body[0] : 0;
+            break;
+        default:
+            break;
     }
-    else
+}
+
+// Consumes the TCP byte stream from the broker
+// A segment can hold several packets and a packet can span several segments. Packets that
+// arrive whole are handled in place, the rest are collected in the decoder buffer. Packets
+// too large for the buffer are skipped.
+void processMqttData(etherHeader *ether, socket *s, uint8_t data[], uint16_t size)
+{
+    uint8_t lengthBytes;
+    uint32_t count;
+
+    while (size > 0)
     {
-        mqttConnected = false;
+        switch (mqttRx.state)
+        {
+            case MQTT_DECODE_HEADER:
+                mqttRx.headerFlags = *data++;
+                size--;
+                mqttRx.lengthBytes = 0;
+                mqttRx.count = 0;
+                mqttRx.state = MQTT_DECODE_LENGTH;
+                break;
+            case MQTT_DECODE_LENGTH:
+                mqttRx.lengthData[mqttRx.lengthBytes++] = *data++;
+                size--;
+                lengthBytes = decodeMqttLength(mqttRx.lengthData, mqttRx.lengthBytes, &mqttRx.remainingLength);
+                if (lengthBytes == 0)
+                {
+                    break;
+                }
+                if (lengthBytes == MQTT_LENGTH_INVALID)
+                {
+                    // Malformed packet, the stream cannot be resynchronized
+                    mqttRx.state = MQTT_DECODE_ERROR;
+                    sendTcpFin(s);
+                    return;
+                }
+                if (mqttRx.remainingLength <= size)
+                {
+                    processMqttPacket(mqttRx.headerFlags, data, mqttRx.remainingLength);
+                    data += mqttRx.remainingLength;
+                    size -= mqttRx.remainingLength;
+                    mqttRx.state = MQTT_DECODE_HEADER;
+                }
+                else if (mqttRx.remainingLength <= MQTT_RX_BUFFER_SIZE)
+                {
+                    mqttRx.state = MQTT_DECODE_BODY;
+                }
+                else
+                {
+                    mqttRx.state = MQTT_DECODE_SKIP;
+                }
+                break;
+            case MQTT_DECODE_BODY:
+            case MQTT_DECODE_SKIP:
+                count = mqttRx.remainingLength - mqttRx.count;
+                if (count > size)
+                {
+                    count = size;
+                }
+                if (mqttRx.state == MQTT_DECODE_BODY)
+                {
+                    memcpy(&mqttRx.buffer[mqttRx.count], data, count);
+                }
+                mqttRx.count += count;
+                data += count;
+                size -= count;
+                if (mqttRx.count == mqttRx.remainingLength)
+                {
+                    if (mqttRx.state == MQTT_DECODE_BODY)
+                    {
+                        processMqttPacket(mqttRx.headerFlags, mqttRx.buffer, mqttRx.remainingLength);
+                    }
+                    mqttRx.state = MQTT_DECODE_HEADER;
+                }
+                break;
+            default:
+                return;
+        }
     }
 }
 
@@ -319,30 +1666,64 @@ bool isMqttConAcked()
     return mqttConnected;
 }
 
-void checkMqttSubAck(etherHeader *ether, socket *s)
+// Last CONNACK return code or MQTT 5.0 reason code from the broker, 0 is success
+uint8_t getMqttReasonCode()
+{
+    return mqttReasonCode;
+}
+
+// True if the broker resumed the session of an earlier connection
+bool isMqttSessionPresent()
+{
+    return mqttSessionPresent;
+}
+
+// Forgets the session when the TCP connection goes away
+void resetMqtt()
 {
-    tcpHeader* tcp = getTcpHeaderPtr(ether);
-    uint8_t headerFlags = tcp->data[0];
+    mqttConnected = false;
+    mqttSessionPresent = false;
+    mqttAliasesSent = 0;
+    mqttAliasesPending = 0;
+    mqttRx.state = MQTT_DECODE_HEADER;
+    mqttResponseTimer = 0;
+    mqttPingNeeded = false;
+    mqttLost = false;
+}
 
-    if (headerFlags == 0x90)
+// Retries the connection after a random delay that doubles with each failed attempt, so
+// a fleet of clients does not reconnect all at once when a broker comes back
+void scheduleMqttReconnect()
+{
+    uint16_t backoff;
+
+    // The next attempt goes to another broker if there is one, except after a failback
+    if (mqttFailingBack)
     {
-        // updateTcpSeqAck(ether, s);
-        s->acknowledgementNumber += 5;
-        sendAck();
-        mqttSubscribed = true;
+        mqttFailingBack = false;
+        mqttReconnectAttempts = 0;
     }
     else
     {
-        mqttSubscribed = false;
+        failMqttBroker(mqttCurrentBroker);
     }
-}
 
-bool isMqttSubAcked()
-{
-    return mqttSubscribed;
+    backoff = 1 << mqttReconnectAttempts;
+
+    if (backoff < MQTT_RECONNECT_MAX_S)
+    {
+        mqttReconnectAttempts++;
+    }
+    else
+    {
+        backoff = MQTT_RECONNECT_MAX_S;
+    }
+    mqttReconnectNeeded = false;
+    mqttReconnectTimer = 1 + random32() % backoff;
 }
 
-void setSubbedTopicLengh(uint16_t len)
+// True once the broker granted the subscription on the current connection
+bool isMqttSubAcked(uint8_t subscription)
 {
-    subbedTopicLength = len;
+    return subscription < MQTT_MAX_SUBSCRIPTIONS && mqttSubscriptions[subscription].granted;
 }
@@ -26,13 +26,99 @@
 
 // TCP Structures
 
+// Fixed header, Remaining Length is a varint of 1 to 4 bytes, 7 bits each, LSB first
 typedef struct _mqttHeader
 {
     uint8_t headerFlags;
-    uint8_t msgLen;
-    uint8_t lengthPayload[0];
+    uint8_t remainingLength[0];
 } mqttHeader;
 
+#define MQTT_MAX_LENGTH_BYTES 4
+#define MQTT_MAX_REMAINING_LENGTH 268435455
+#define MQTT_LENGTH_INVALID 0xFF
+
+// Control packet types, upper nibble of headerFlags
+#define MQTT_CONNECT     1
+#define MQTT_CONNACK     2
+#define MQTT_PUBLISH     3
+#define MQTT_PUBACK      4
+#define MQTT_PUBREC      5
+#define MQTT_PUBREL      6
+#define MQTT_PUBCOMP     7
+#define MQTT_SUBSCRIBE   8
+#define MQTT_SUBACK      9
+#define MQTT_UNSUBSCRIBE 10
+#define MQTT_UNSUBACK    11
+#define MQTT_PINGREQ     12
+#define MQTT_PINGRESP    13
+#define MQTT_DISCONNECT  14
+
+// Keepalive and reconnect
+#define MQTT_KEEPALIVE_S 60             // PINGREQ after this long without sending
+#define MQTT_RESPONSE_TIMEOUT_S 10      // Wait for CONNACK or PINGRESP before dropping the connection
+#define MQTT_RECONNECT_MAX_S 64         // Backoff doubles from 1 s up to this, the delay is picked at random below it
+
+// Session
+#define MQTT_CLIENT_ID_PREFIX "plant"   // Client ID is the prefix and the MAC in hex, stable across restarts
+
+// Broker failover
+// Brokers are tried by priority. One that fails is held down for a while and the next one is
+// used; once a better broker may be tried again, a connection to a backup is moved back to it.
+#define MQTT_PORT 1883
+#define MQTT_MAX_BROKERS 4
+#define MQTT_BROKER_INVALID 0xFF
+#define MQTT_BROKER_HOLD_S 60           // Skipped after a failure, doubles with failures in a row
+#define MQTT_FAILBACK_S 300             // Least time on a backup before moving back
+
+typedef struct _mqttBroker
+{
+    uint8_t ip[IP_ADD_LENGTH];
+    uint16_t port;
+    uint8_t priority;               // Lower is preferred
+    uint8_t failures;               // In a row, cleared by a CONNACK
+    uint32_t retryAt;               // Uptime when it may be tried again
+    bool inUse;
+} mqttBroker;
+
+// Protocol level byte of CONNECT
+#define MQTT_VERSION_311 4
+#define MQTT_VERSION_5   5
+
+// MQTT 5.0 properties, identifier then value
+#define MQTT_PROP_SESSION_EXPIRY  0x11  // 4 bytes
+#define MQTT_PROP_SERVER_KEEP_ALIVE 0x13 // 2 bytes
+#define MQTT_PROP_RECEIVE_MAXIMUM 0x21  // 2 bytes
+#define MQTT_PROP_TOPIC_ALIAS_MAX 0x22  // 2 bytes
+#define MQTT_PROP_TOPIC_ALIAS     0x23  // 2 bytes
+#define MQTT_PROPERTIES_INVALID   0xFFFF
+
+#define MQTT_SESSION_EXPIRY_S 86400     // MQTT 5.0, how long the broker keeps a persistent session
+
+// Stream decoder
+#define MQTT_RX_BUFFER_SIZE 256     // Largest packet that can be split across segments
+
+#define MQTT_DECODE_HEADER 0
+#define MQTT_DECODE_LENGTH 1
+#define MQTT_DECODE_BODY   2
+#define MQTT_DECODE_SKIP   3        // Too large for the buffer
+#define MQTT_DECODE_ERROR  4        // Malformed, ignored until reconnected
+
+typedef struct _mqttDecoder
+{
+    uint8_t state;
+    uint8_t headerFlags;
+    uint8_t lengthData[MQTT_MAX_LENGTH_BYTES];
+    uint8_t lengthBytes;
+    uint32_t remainingLength;
+    uint32_t count;                 // Body bytes collected or skipped so far
+    uint8_t buffer[MQTT_RX_BUFFER_SIZE];
+} mqttDecoder;
+
+// Called for each PUBLISH matching a subscription, topic is not zero terminated
+// Must not send, the rest of the segment may still be waiting in the frame
+typedef void (*_mqttMessageCallback)(char topic[], uint16_t topicLength, uint8_t data[], uint16_t dataLength,
+                                     void *context);
+
 typedef struct _mqttConnect
 {
     uint16_t protocolNameLength;
@@ -53,12 +139,9 @@ typedef struct _mqttPublish
 
 typedef struct _mqttSubscribeHeader
 {
-    uint8_t headerFlags;
-    uint8_t msgLen;
     uint16_t MessageIdentifier;
     uint8_t lengthPayload[0];
-
-} mqttSubscribeHeader;
+} mqttSubscribeHeader;             // Variable header of SUBSCRIBE and UNSUBSCRIBE
 
 typedef struct _mqttSubscribe
 {
@@ -67,21 +150,133 @@ typedef struct _mqttSubscribe
     uint8_t qos;
 } mqttSubscribe;
 
+// Topic registry
+// Topics are encoded once into their wire form (16-bit length, then the name) and
+// published by handle
+#define MQTT_MAX_TOPICS 16              // At most 16, MQTT 5.0 aliases are tracked in a bit mask
+#define MQTT_TOPIC_BLOB_SIZE 512
+#define MQTT_TOPIC_INVALID 0xFF
+
+typedef struct _mqttTopicEntry
+{
+    uint16_t offset;                // Wire form in the blob, alias right after it
+    uint16_t size;                  // Wire size, 2 + name length
+    uint32_t hash;
+    uint32_t aliasHash;
+    uint8_t aliasLength;
+} mqttTopicEntry;
+
+// Subscriptions
+// Filters are kept in a trie with one node per level, so a PUBLISH is matched by walking
+// its topic once no matter how many filters share a prefix
+#define MQTT_MAX_SUBSCRIPTIONS 8        // At most 32, matches are collected in a bit mask
+#define MQTT_FILTER_SIZE 64             // Longest filter, zero terminated
+#define MQTT_TRIE_NODES 32
+#define MQTT_LEVEL_SIZE 20              // Longest filter level, zero terminated
+#define MQTT_TRIE_NONE 0xFF
+#define MQTT_SUBSCRIPTION_INVALID 0xFF
+
+typedef struct _mqttTrieNode
+{
+    char level[MQTT_LEVEL_SIZE];    // Name, + or #
+    uint8_t levelLength;
+    uint8_t child;                  // First node of the next level
+    uint8_t sibling;                // Next node of this level
+    uint8_t subscription;           // Filter ending here, MQTT_SUBSCRIPTION_INVALID if none
+    bool inUse;
+} mqttTrieNode;
+
+typedef struct _mqttSubscription
+{
+    char filter[MQTT_FILTER_SIZE];
+    _mqttMessageCallback callback;
+    void *context;
+    uint16_t packetId;              // SUBSCRIBE awaiting SUBACK
+    bool inUse;
+    bool subscribeNeeded;
+    bool unsubscribeNeeded;         // Removed from the trie, slot freed once sent
+    bool granted;
+} mqttSubscription;
+
+// QoS 1 publishing
+#define MQTT_INFLIGHT_WINDOW 8          // PUBLISHes awaiting PUBACK, a plant snapshot fits
+#define MQTT_INFLIGHT_PACKET_SIZE 160   // Largest QoS 1 PUBLISH, kept for retransmission, fits a JSON snapshot
+
+// Priority lanes
+// Alarms go out ahead of telemetry still waiting in the window and have slots of their own,
+// so a backlog of stored samples never holds them up
+#define MQTT_LANE_TELEMETRY 0
+#define MQTT_LANE_ALARM     1
+#define MQTT_ALARM_RESERVED 2           // In-flight slots telemetry may not take
+#define MQTT_TELEMETRY_WINDOW (MQTT_INFLIGHT_WINDOW - MQTT_ALARM_RESERVED)
+
+// Called when the broker acknowledges a QoS 1 PUBLISH, same rules as _mqttMessageCallback
+typedef void (*_mqttCompleteCallback)(uint16_t packetId, void *context);
+
+typedef struct _mqttInflightMessage
+{
+    uint16_t packetId;              // 0 when free
+    uint16_t order;                 // Publish order, resends keep it
+    uint8_t lane;
+    bool retain;
+    bool sent;
+    bool resendNeeded;
+    uint8_t topic;                  // Rebuilt from these on resend, topic aliases do not outlive a connection
+    uint8_t payloadOffset;
+    uint16_t size;
+    _mqttCompleteCallback callback;
+    void *context;
+    uint8_t packet[MQTT_INFLIGHT_PACKET_SIZE];
+} mqttInflightMessage;
+
 //-----------------------------------------------------------------------------
 // Subroutines
 //-----------------------------------------------------------------------------
 
+uint8_t encodeMqttLength(uint8_t data[], uint32_t length);
+uint8_t decodeMqttLength(uint8_t data[], uint16_t size, uint32_t *length);
+uint8_t* putMqttHeader(uint8_t data[], uint8_t headerFlags, uint32_t remainingLength);
+void mqttTick(void);
+uint8_t addMqttBroker(const uint8_t ip[4], uint16_t port, uint8_t priority);
+void clearMqttBrokers(void);
+mqttBroker* getMqttBroker(uint8_t broker);
+uint8_t getMqttCurrentBroker(void);
+bool startMqttConnection(socket *s);
+void setMqttVersion(uint8_t version);
+uint8_t getMqttVersion(void);
+void setMqttCleanSession(bool clean);
 void connectMqtt(etherHeader *ether, socket *s);
 void disconnectMqtt(etherHeader *ether, socket *s);
-void publishMqtt(etherHeader *ether, socket *s, char strTopic[], char strData[]);
-void subscribeMqtt(etherHeader *ether, socket *s, char strTopic[]);
-void unsubscribeMqtt(etherHeader *ether, socket *s, char strTopic[]);
-void checkMqttConAck(etherHeader *ether, socket *s);
+uint8_t registerMqttTopic(char strTopic[], char strAlias[]);
+uint8_t findMqttTopic(char str[]);
+char* getMqttTopicName(uint8_t topic, uint16_t *length);
+uint16_t putMqttPublish(uint8_t *start, uint16_t maxSize, uint8_t headerFlags, uint8_t topic,
+                        uint8_t data[], uint16_t dataLength, uint16_t packetId);
+void publishMqtt(etherHeader *ether, socket *s, uint8_t topic, char strData[]);
+uint16_t publishMqttQos1(etherHeader *ether, socket *s, uint8_t topic, char strData[],
+                         _mqttCompleteCallback callback, void *context);
+uint16_t publishMqttQos1Data(etherHeader *ether, socket *s, uint8_t topic, uint8_t data[], uint16_t dataLength,
+                             _mqttCompleteCallback callback, void *context);
+uint16_t publishMqttAlarm(etherHeader *ether, socket *s, uint8_t topic, char strData[],
+                          _mqttCompleteCallback callback, void *context);
+uint8_t* reserveMqttPublishQos1(etherHeader *ether, socket *s, uint8_t topic, uint16_t *maxSize);
+uint16_t commitMqttPublishQos1(etherHeader *ether, socket *s, uint8_t topic, uint16_t dataLength,
+                               _mqttCompleteCallback callback, void *context);
+uint8_t getMqttInflightCount(void);
+void startMqttBatch(void);
+bool endMqttBatch(etherHeader *ether, socket *s);
+void sendMqttPendingMessages(etherHeader *ether, socket *s);
+void sendMqttSubscriptions(etherHeader *ether, socket *s);
+uint8_t subscribeMqtt(char strFilter[], _mqttMessageCallback callback, void *context);
+bool unsubscribeMqtt(char strFilter[]);
+uint32_t matchMqttTopic(char topic[], uint16_t topicLength);
+void processMqttData(etherHeader *ether, socket *s, uint8_t data[], uint16_t size);
 bool isMqttConAcked(void);
-bool processPubMessage(etherHeader *ether, socket *s, char topicData[]);
-void checkMqttSubAck(etherHeader *ether, socket *s);
-bool isMqttSubAcked(void);
-void setSubbedTopicLengh(uint16_t len);
+bool isMqttSessionPresent(void);
+uint8_t getMqttReasonCode(void);
+void resetMqtt(void);
+void scheduleMqttReconnect(void);
+bool isMqttSubAcked(uint8_t subscription);
 
 #endif
 
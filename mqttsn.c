@@ -0,0 +1,558 @@
+// MQTT-SN Client
+// MQTT for Sensor Networks v1.2 over UDP
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: -
+// Target uC:       -
+// System Clock:    -
+
+// Hardware configuration:
+// -
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+// Publishes through an MQTT-SN gateway (e.g. Eclipse Paho MQTT-SN Gateway), which
+// forwards to the broker. There is no handshake beyond CONNECT/CONNACK and a PUBLISH
+// carries a 2 byte topic ID instead of the topic name.
+//
+// Topics come from the MQTT topic registry. Those passed to useMqttsnTopic are
+// registered with the gateway after each CONNACK, predefined ones are configured on the
+// gateway and also work with QoS -1, which needs no connection at all.
+//
+// Like the TCP client only one transaction (CONNECT, REGISTER or QoS 1 PUBLISH) is
+// outstanding at a time, it is resent every MQTTSN_RETRY_S seconds. A PINGREQ goes out
+// after MQTTSN_KEEPALIVE_S quiet seconds. When the gateway stops answering the client
+// starts over from ARP and registers its topics again.
+
+#include <string.h>
+#include "mqttsn.h"
+#include "arp.h"
+#include "udp.h"
+#include "eth0.h"
+
+// ------------------------------------------------------------------------------
+//  Globals
+// ------------------------------------------------------------------------------
+
+mqttsnClient mqttsn;
+// Seconds counted by the timer ISR and those already run by sendMqttsnPendingMessages
+volatile uint8_t mqttsnTicks = 0;
+uint8_t mqttsnTicksDone = 0;
+mqttsnTopic mqttsnTopics[MQTTSN_MAX_TOPICS];
+uint8_t mqttsnTopicCount = 0;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+// Gateway is unknown or lost, resolves it again and registers topics anew
+// A QoS 1 PUBLISH still awaiting its PUBACK is dropped
+void restartMqttsn()
+{
+    uint8_t i;
+
+    mqttsn.state = MQTTSN_RESOLVING;
+    mqttsn.arpNeeded = true;
+    mqttsn.resendNeeded = false;
+    mqttsn.pingNeeded = false;
+    mqttsn.pingOutstanding = false;
+    mqttsn.awaiting = 0;
+    mqttsn.retries = 0;
+    mqttsn.timer = MQTTSN_RETRY_S;
+
+    // Clean session, topic IDs are only valid for one connection
+    for (i = 0; i < mqttsnTopicCount; i++)
+    {
+        mqttsnTopics[i].registered = mqttsnTopics[i].predefined;
+        mqttsnTopics[i].rejected = false;
+    }
+}
+
+// Counts seconds for processMqttsnTimers, called from the shared 1 second timer
+void mqttsnTick()
+{
+    mqttsnTicks++;
+}
+
+// Reply timeouts and keepalive for one second
+void processMqttsnSecond()
+{
+    if (mqttsn.state == MQTTSN_DISCONNECTED)
+    {
+        return;
+    }
+
+    if ((mqttsn.state == MQTTSN_RESOLVING || mqttsn.awaiting != 0) && mqttsn.timer > 0 && --mqttsn.timer == 0)
+    {
+        if (mqttsn.retries >= MQTTSN_RETRIES)
+        {
+            restartMqttsn();
+            return;
+        }
+        mqttsn.retries++;
+        mqttsn.timer = MQTTSN_RETRY_S;
+        if (mqttsn.state == MQTTSN_RESOLVING)
+        {
+            mqttsn.arpNeeded = true;
+        }
+        else
+        {
+            mqttsn.resendNeeded = true;
+        }
+    }
+
+    if (mqttsn.state == MQTTSN_CONNECTED)
+    {
+        mqttsn.idle++;
+        if (!mqttsn.pingOutstanding && mqttsn.idle >= mqttsn.keepAlive)
+        {
+            mqttsn.pingOutstanding = true;
+            mqttsn.pingNeeded = true;
+            mqttsn.pingRetries = 0;
+            mqttsn.pingTimer = MQTTSN_RETRY_S;
+        }
+        else if (mqttsn.pingOutstanding && --mqttsn.pingTimer == 0)
+        {
+            if (mqttsn.pingRetries >= MQTTSN_RETRIES)
+            {
+                restartMqttsn();
+                return;
+            }
+            mqttsn.pingRetries++;
+            mqttsn.pingNeeded = true;
+            mqttsn.pingTimer = MQTTSN_RETRY_S;
+        }
+    }
+}
+
+// Runs every second counted since the last call
+void processMqttsnTimers()
+{
+    while (mqttsnTicksDone != mqttsnTicks)
+    {
+        mqttsnTicksDone++;
+        processMqttsnSecond();
+    }
+}
+
+void initMqttsn()
+{
+    mqttsn.state = MQTTSN_DISCONNECTED;
+    mqttsn.keepAlive = MQTTSN_KEEPALIVE_S;
+}
+
+// Next message identifier, never 0
+uint16_t getMqttsnMsgId()
+{
+    mqttsn.msgId++;
+    if (mqttsn.msgId == 0)
+    {
+        mqttsn.msgId = 1;
+    }
+    return mqttsn.msgId;
+}
+
+// Where a message is built in the outbound frame
+// sendUdpMessage copies from the front, so the payload does not move
+uint8_t* reserveMqttsnMessage(etherHeader *ether)
+{
+    return (uint8_t*)ether->data + sizeof(ipHeader) + sizeof(udpHeader);
+}
+
+void sendMqttsnMessage(etherHeader *ether, uint8_t data[], uint8_t size)
+{
+    sendUdpMessage(ether, mqttsn.s, data, size);
+    mqttsn.idle = 0;
+}
+
+// Keeps the message in mqttsn.packet until its reply arrives
+void startMqttsnTransaction(uint8_t data[], uint8_t size, uint8_t reply, uint16_t msgId)
+{
+    memcpy(mqttsn.packet, data, size);
+    mqttsn.size = size;
+    mqttsn.awaiting = reply;
+    mqttsn.awaitingMsgId = msgId;
+    mqttsn.retries = 0;
+    mqttsn.timer = MQTTSN_RETRY_S;
+}
+
+// Starts connecting, the gateway is resolved with ARP first
+void connectMqttsn(uint8_t gatewayIp[], uint16_t gatewayPort)
+{
+    memcpy(mqttsn.s.remoteIpAddress, gatewayIp, IP_ADD_LENGTH);
+    mqttsn.s.remotePort = gatewayPort;
+    mqttsn.s.localPort = MQTTSN_PORT;
+    restartMqttsn();
+}
+
+void disconnectMqttsn(etherHeader *ether)
+{
+    uint8_t *data = reserveMqttsnMessage(ether);
+
+    if (mqttsn.state == MQTTSN_CONNECTING || mqttsn.state == MQTTSN_CONNECTED)
+    {
+        data[0] = 2;
+        data[1] = MQTTSN_DISCONNECT;
+        sendMqttsnMessage(ether, data, 2);
+    }
+    mqttsn.state = MQTTSN_DISCONNECTED;
+    mqttsn.awaiting = 0;
+}
+
+// CONNECT with a clean session, the client ID is "plant" and the MAC in hex
+void sendMqttsnConnect(etherHeader *ether)
+{
+    uint8_t *data = reserveMqttsnMessage(ether);
+    uint8_t *p = &data[2];
+    uint8_t mac[HW_ADD_LENGTH];
+    uint8_t i;
+
+    data[1] = MQTTSN_CONNECT;
+    *p++ = MQTTSN_FLAG_CLEAN;
+    *p++ = 0x01;                                    // Protocol ID
+    *p++ = mqttsn.keepAlive >> 8;
+    *p++ = mqttsn.keepAlive & 0xFF;
+    memcpy(p, "plant", 5);
+    p += 5;
+    getEtherMacAddress(mac);
+    for (i = 0; i < HW_ADD_LENGTH; i++)
+    {
+        *p++ = "0123456789abcdef"[mac[i] >> 4];
+        *p++ = "0123456789abcdef"[mac[i] & 0x0F];
+    }
+    data[0] = p - data;
+
+    startMqttsnTransaction(data, data[0], MQTTSN_CONNACK, 0);
+    sendMqttsnMessage(ether, data, data[0]);
+}
+
+// REGISTER for the next topic without an ID
+void sendMqttsnRegister(etherHeader *ether)
+{
+    uint8_t *data = reserveMqttsnMessage(ether);
+    uint16_t msgId, length;
+    char *name;
+    uint8_t i;
+
+    for (i = 0; i < mqttsnTopicCount && (mqttsnTopics[i].registered || mqttsnTopics[i].rejected); i++);
+    if (i == mqttsnTopicCount)
+    {
+        return;
+    }
+    name = getMqttTopicName(mqttsnTopics[i].topic, &length);
+    if (name == NULL || 6 + length > MQTTSN_PACKET_SIZE)
+    {
+        mqttsnTopics[i].rejected = true;
+        return;
+    }
+
+    msgId = getMqttsnMsgId();
+    data[0] = 6 + length;
+    data[1] = MQTTSN_REGISTER;
+    data[2] = 0;                                    // Topic ID, assigned by the gateway
+    data[3] = 0;
+    data[4] = msgId >> 8;
+    data[5] = msgId & 0xFF;
+    memcpy(&data[6], name, length);
+
+    mqttsn.awaitingTopic = i;
+    startMqttsnTransaction(data, data[0], MQTTSN_REGACK, msgId);
+    sendMqttsnMessage(ether, data, data[0]);
+}
+
+// Gateways off our subnet are reached through the IP gateway, that is who gets asked
+void getMqttsnArpTarget(uint8_t ip[])
+{
+    if (isIpLocal(mqttsn.s.remoteIpAddress))
+    {
+        memcpy(ip, mqttsn.s.remoteIpAddress, IP_ADD_LENGTH);
+    }
+    else
+    {
+        getIpGatewayAddress(ip);
+    }
+}
+
+void processMqttsnArpResponse(etherHeader *ether)
+{
+    arpPacket *arp = (arpPacket*)ether->data;
+    uint8_t target[IP_ADD_LENGTH];
+
+    getMqttsnArpTarget(target);
+    if (mqttsn.state != MQTTSN_RESOLVING || memcmp(arp->sourceIp, target, IP_ADD_LENGTH) != 0)
+    {
+        return;
+    }
+    memcpy(mqttsn.s.remoteHwAddress, arp->sourceAddress, HW_ADD_LENGTH);
+    mqttsn.state = MQTTSN_CONNECTING;
+    mqttsn.arpNeeded = false;
+
+    // Sent from sendMqttsnPendingMessages, the frame still holds the ARP response
+    mqttsn.awaiting = MQTTSN_CONNACK;
+    mqttsn.size = 0;
+    mqttsn.resendNeeded = true;
+}
+
+// Must be called with a free frame
+void sendMqttsnPendingMessages(etherHeader *ether)
+{
+    uint8_t localIp[IP_ADD_LENGTH];
+    uint8_t target[IP_ADD_LENGTH];
+    uint8_t *data;
+
+    processMqttsnTimers();
+    if (mqttsn.state == MQTTSN_DISCONNECTED)
+    {
+        return;
+    }
+    if (mqttsn.arpNeeded)
+    {
+        mqttsn.arpNeeded = false;
+        getIpAddress(localIp);
+        getMqttsnArpTarget(target);
+        sendArpRequest(ether, localIp, target);
+        return;
+    }
+    if (mqttsn.resendNeeded)
+    {
+        mqttsn.resendNeeded = false;
+        if (mqttsn.size == 0)
+        {
+            sendMqttsnConnect(ether);
+        }
+        else
+        {
+            data = reserveMqttsnMessage(ether);
+            memcpy(data, mqttsn.packet, mqttsn.size);
+            if (data[1] == MQTTSN_PUBLISH && mqttsn.retries > 0)
+            {
+                data[2] |= MQTTSN_FLAG_DUP;
+            }
+            sendMqttsnMessage(ether, data, mqttsn.size);
+        }
+        return;
+    }
+    if (mqttsn.pingNeeded)
+    {
+        mqttsn.pingNeeded = false;
+        data = reserveMqttsnMessage(ether);
+        data[0] = 2;
+        data[1] = MQTTSN_PINGREQ;
+        sendMqttsnMessage(ether, data, 2);
+        return;
+    }
+
+    // Topics are registered one at a time once connected
+    if (mqttsn.state == MQTTSN_CONNECTED && mqttsn.awaiting == 0)
+    {
+        sendMqttsnRegister(ether);
+    }
+}
+
+uint8_t findMqttsnTopic(uint8_t topic)
+{
+    uint8_t i;
+
+    for (i = 0; i < mqttsnTopicCount && mqttsnTopics[i].topic != topic; i++);
+    return i;
+}
+
+// Adds a registry topic, it is registered with the gateway after each CONNACK
+bool useMqttsnTopic(uint8_t topic)
+{
+    uint8_t i = findMqttsnTopic(topic);
+
+    if (i == mqttsnTopicCount)
+    {
+        if (mqttsnTopicCount == MQTTSN_MAX_TOPICS || getMqttTopicName(topic, NULL) == NULL)
+        {
+            return false;
+        }
+        mqttsnTopics[i].topic = topic;
+        mqttsnTopics[i].predefined = false;
+        mqttsnTopics[i].registered = false;
+        mqttsnTopics[i].rejected = false;
+        mqttsnTopicCount++;
+    }
+    return true;
+}
+
+// Uses a topic ID configured on the gateway, no REGISTER needed
+bool setMqttsnPredefinedTopic(uint8_t topic, uint16_t topicId)
+{
+    uint8_t i;
+
+    if (!useMqttsnTopic(topic))
+    {
+        return false;
+    }
+    i = findMqttsnTopic(topic);
+    mqttsnTopics[i].topicId = topicId;
+    mqttsnTopics[i].predefined = true;
+    mqttsnTopics[i].registered = true;
+    return true;
+}
+
+// Publishes with QoS -1, 0 or 1
+// QoS -1 needs a predefined topic and only the gateway's address, 0 and 1 a connection and
+// a registered topic. Only one QoS 1 PUBLISH can await its PUBACK, callback runs with
+// context when it arrives. Returns false if the message cannot go out now.
+bool publishMqttsn(etherHeader *ether, uint8_t topic, uint8_t data[], uint16_t size, int8_t qos,
+                   _mqttCompleteCallback callback, void *context)
+{
+    uint8_t i = findMqttsnTopic(topic);
+    uint8_t *p = reserveMqttsnMessage(ether);
+    mqttsnTopic *t = &mqttsnTopics[i];
+    uint16_t msgId = 0;
+
+    if (i == mqttsnTopicCount || 7 + size > MQTTSN_PACKET_SIZE)
+    {
+        return false;
+    }
+    if (qos < 0)
+    {
+        if (!t->predefined || mqttsn.state < MQTTSN_CONNECTING)
+        {
+            return false;
+        }
+        p[2] = MQTTSN_FLAG_QOS_M1 | MQTTSN_TOPIC_PREDEFINED;
+    }
+    else
+    {
+        if (mqttsn.state != MQTTSN_CONNECTED || !t->registered || (qos > 0 && mqttsn.awaiting != 0))
+        {
+            return false;
+        }
+        p[2] = ((qos > 0) ? MQTTSN_FLAG_QOS1 : MQTTSN_FLAG_QOS0)
+             | (t->predefined ? MQTTSN_TOPIC_PREDEFINED : MQTTSN_TOPIC_NORMAL);
+        if (qos > 0)
+        {
+            msgId = getMqttsnMsgId();
+        }
+    }
+
+    p[0] = 7 + size;
+    p[1] = MQTTSN_PUBLISH;
+    p[3] = t->topicId >> 8;
+    p[4] = t->topicId & 0xFF;
+    p[5] = msgId >> 8;
+    p[6] = msgId & 0xFF;
+    memcpy(&p[7], data, size);
+
+    if (msgId != 0)
+    {
+        mqttsn.awaitingTopic = i;
+        mqttsn.callback = callback;
+        mqttsn.context = context;
+        startMqttsnTransaction(p, p[0], MQTTSN_PUBACK, msgId);
+    }
+    sendMqttsnMessage(ether, p, p[0]);
+    return true;
+}
+
+// Datagram from the gateway
+bool isMqttsn(etherHeader *ether)
+{
+    ipHeader *ip = (ipHeader*)ether->data;
+    udpHeader *udp = (udpHeader*)(getUdpData(ether) - sizeof(udpHeader));
+
+    return mqttsn.state != MQTTSN_DISCONNECTED
+        && ntohs(udp->destPort) == mqttsn.s.localPort
+        && ntohs(udp->sourcePort) == mqttsn.s.remotePort
+        && memcmp(ip->sourceIp, mqttsn.s.remoteIpAddress, IP_ADD_LENGTH) == 0;
+}
+
+// Handles a reply from the gateway, nothing here may send
+void processMqttsn(etherHeader *ether)
+{
+    udpHeader *udp = (udpHeader*)(getUdpData(ether) - sizeof(udpHeader));
+    uint16_t size = ntohs(udp->length) - sizeof(udpHeader);
+    uint8_t *data = udp->data;
+    uint16_t length, msgId;
+    uint8_t type, *body;
+    mqttsnTopic *t = &mqttsnTopics[mqttsn.awaitingTopic];
+
+    // 1 byte length, or 0x01 and 2 more bytes
+    if (size >= 4 && data[0] == 0x01)
+    {
+        length = (data[1] << 8) | data[2];
+        type = data[3];
+        body = &data[4];
+        length -= 4;
+    }
+    else if (size >= 2 && data[0] >= 2)
+    {
+        length = data[0];
+        type = data[1];
+        body = &data[2];
+        length -= 2;
+    }
+    else
+    {
+        return;
+    }
+    if (body + length > data + size)
+    {
+        return;
+    }
+    msgId = (length >= 4) ? (body[2] << 8) | body[3] : 0;
+
+    switch (type)
+    {
+        case MQTTSN_CONNACK:
+            if (mqttsn.awaiting == MQTTSN_CONNACK && length >= 1)
+            {
+                mqttsn.awaiting = 0;
+                mqttsn.state = (body[0] == MQTTSN_ACCEPTED) ? MQTTSN_CONNECTED : MQTTSN_DISCONNECTED;
+                mqttsn.idle = 0;
+            }
+            break;
+        case MQTTSN_REGACK:
+            if (mqttsn.awaiting == MQTTSN_REGACK && length >= 5 && msgId == mqttsn.awaitingMsgId)
+            {
+                mqttsn.awaiting = 0;
+                t->topicId = (body[0] << 8) | body[1];
+                t->registered = (body[4] == MQTTSN_ACCEPTED);
+                t->rejected = !t->registered;
+            }
+            break;
+        case MQTTSN_PUBACK:
+            if (mqttsn.awaiting == MQTTSN_PUBACK && length >= 5 && msgId == mqttsn.awaitingMsgId)
+            {
+                mqttsn.awaiting = 0;
+
+                // The gateway lost the topic ID, it is registered again
+                if (body[4] == MQTTSN_INVALID_TOPIC && !t->predefined)
+                {
+                    t->registered = false;
+                }
+                if (body[4] == MQTTSN_ACCEPTED && mqttsn.callback != NULL)
+                {
+                    mqttsn.callback(msgId, mqttsn.context);
+                }
+            }
+            break;
+        case MQTTSN_PINGRESP:
+            mqttsn.pingOutstanding = false;
+            break;
+        case MQTTSN_DISCONNECT:
+            // Gateway dropped us, connect again
+            if (mqttsn.state == MQTTSN_CONNECTED)
+            {
+                restartMqttsn();
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+uint8_t getMqttsnState()
+{
+    return mqttsn.state;
+}
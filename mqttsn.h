@@ -0,0 +1,116 @@
+// MQTT-SN Client
+// MQTT for Sensor Networks v1.2 over UDP
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: -
+// Target uC:       -
+// System Clock:    -
+
+// Hardware configuration:
+// -
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#ifndef MQTTSN_H_
+#define MQTTSN_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ip.h"
+#include "socket.h"
+#include "mqtt.h"
+
+#define MQTTSN_PORT 1884                // Local port, and the gateway's unless given
+#define MQTTSN_KEEPALIVE_S 60
+#define MQTTSN_RETRY_S 10               // Tretry, wait for a reply
+#define MQTTSN_RETRIES 4                // Nretry, then the gateway is considered lost
+#define MQTTSN_MAX_TOPICS 8
+#define MQTTSN_PACKET_SIZE 160
+
+// Message types
+#define MQTTSN_CONNECT    0x04
+#define MQTTSN_CONNACK    0x05
+#define MQTTSN_REGISTER   0x0A
+#define MQTTSN_REGACK     0x0B
+#define MQTTSN_PUBLISH    0x0C
+#define MQTTSN_PUBACK     0x0D
+#define MQTTSN_PINGREQ    0x16
+#define MQTTSN_PINGRESP   0x17
+#define MQTTSN_DISCONNECT 0x18
+
+// Flags
+#define MQTTSN_FLAG_DUP         0x80
+#define MQTTSN_FLAG_QOS0        0x00
+#define MQTTSN_FLAG_QOS1        0x20
+#define MQTTSN_FLAG_QOS_M1      0x60
+#define MQTTSN_FLAG_CLEAN       0x04
+#define MQTTSN_TOPIC_NORMAL     0x00
+#define MQTTSN_TOPIC_PREDEFINED 0x01
+
+#define MQTTSN_ACCEPTED 0x00
+#define MQTTSN_INVALID_TOPIC 0x02
+
+// Client states
+#define MQTTSN_DISCONNECTED 0
+#define MQTTSN_RESOLVING    1           // ARP for the gateway
+#define MQTTSN_CONNECTING   2           // CONNECT sent
+#define MQTTSN_CONNECTED    3
+
+typedef struct _mqttsnTopic
+{
+    uint8_t topic;                  // Handle in the MQTT topic registry
+    uint16_t topicId;               // From REGACK, or predefined
+    bool predefined;                // Known to the gateway, usable with QoS -1
+    bool registered;
+    bool rejected;                  // Gateway refused the REGISTER
+} mqttsnTopic;
+
+typedef struct _mqttsnClient
+{
+    socket s;                       // Gateway
+    uint8_t state;
+    uint16_t msgId;
+    uint16_t keepAlive;
+    uint16_t idle;                  // Seconds since the last message to the gateway
+    bool arpNeeded;
+    bool resendNeeded;
+    bool pingNeeded;
+    bool pingOutstanding;           // PINGREQ awaiting PINGRESP
+    uint8_t pingRetries;
+    uint8_t pingTimer;
+    // The one transaction awaiting a reply: CONNECT, REGISTER or QoS 1 PUBLISH
+    uint8_t awaiting;               // Reply type, 0 when idle
+    uint16_t awaitingMsgId;
+    uint8_t awaitingTopic;          // Index in the topic table
+    uint8_t retries;
+    uint8_t timer;
+    uint8_t size;
+    uint8_t packet[MQTTSN_PACKET_SIZE];
+    _mqttCompleteCallback callback;
+    void *context;
+} mqttsnClient;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+void initMqttsn(void);
+void mqttsnTick(void);
+void connectMqttsn(uint8_t gatewayIp[], uint16_t gatewayPort);
+void disconnectMqttsn(etherHeader *ether);
+bool useMqttsnTopic(uint8_t topic);
+bool setMqttsnPredefinedTopic(uint8_t topic, uint16_t topicId);
+bool publishMqttsn(etherHeader *ether, uint8_t topic, uint8_t data[], uint16_t size, int8_t qos,
+                   _mqttCompleteCallback callback, void *context);
+bool isMqttsn(etherHeader *ether);
+void processMqttsn(etherHeader *ether);
+void processMqttsnArpResponse(etherHeader *ether);
+void sendMqttsnPendingMessages(etherHeader *ether);
+uint8_t getMqttsnState(void);
+
+#endif
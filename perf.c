@@ -0,0 +1,159 @@
+// Throughput Test Service
+// Echo (RFC 862) and discard (RFC 863) endpoints over TCP and UDP
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: -
+// Target uC:       -
+// System Clock:    -
+
+// Hardware configuration:
+// -
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+// Works like a tiny iperf endpoint: a host pushes data at port 9 to measure the
+// receive path, or at port 7 to measure both directions. Counters are kept per
+// protocol and read from the shell with "perf".
+
+#include <string.h>
+#include "perf.h"
+#include "tcp.h"
+#include "udp.h"
+
+// ------------------------------------------------------------------------------
+//  Globals
+// ------------------------------------------------------------------------------
+
+bool perfEnabled = false;
+uint32_t perfSeconds = 0;
+perfCounters perfStats[2];
+
+void perfTcpReceived(etherHeader *ether, socket *s, uint8_t data[], uint16_t size);
+const socketCallbacks perfTcpCallbacks = {NULL, perfTcpReceived, NULL, NULL};
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+// Called from the shared 1 second timer
+void callbackPerfTimer(void)
+{
+    perfSeconds++;
+}
+
+void initPerf(void)
+{
+    resetPerfCounters();
+}
+
+// Opens the TCP echo and discard ports next to any other listening ports
+void enablePerf(void)
+{
+    perfEnabled = true;
+    addTcpPort(PERF_ECHO_PORT, &perfTcpCallbacks, NULL);
+    addTcpPort(PERF_DISCARD_PORT, &perfTcpCallbacks, NULL);
+}
+
+// Closes only the perf ports, connections already open run until the peer closes them
+void disablePerf(void)
+{
+    perfEnabled = false;
+    removeTcpPort(PERF_ECHO_PORT);
+    removeTcpPort(PERF_DISCARD_PORT);
+}
+
+bool isPerfEnabled(void)
+{
+    return perfEnabled;
+}
+
+void resetPerfCounters(void)
+{
+    memset(perfStats, 0, sizeof(perfStats));
+}
+
+perfCounters* getPerfCounters(uint8_t mode)
+{
+    return &perfStats[mode];
+}
+
+// Seconds between the first and last counted segment, at least 1 once anything arrived
+uint32_t getPerfElapsedSeconds(uint8_t mode)
+{
+    perfCounters *c = &perfStats[mode];
+
+    if (c->rxSegments == 0)
+    {
+        return 0;
+    }
+    return c->lastSecond - c->firstSecond + 1;
+}
+
+void countPerfReceived(perfCounters *c, uint16_t size)
+{
+    if (c->rxSegments == 0)
+    {
+        c->firstSecond = perfSeconds;
+    }
+    c->lastSecond = perfSeconds;
+    c->rxBytes += size;
+    c->rxSegments++;
+}
+
+// Counts in-order data and echoes it back on port 7
+void perfTcpReceived(etherHeader *ether, socket *s, uint8_t data[], uint16_t size)
+{
+    perfCounters *c = &perfStats[PERF_TCP];
+
+    countPerfReceived(c, size);
+
+    if (s->localPort == PERF_ECHO_PORT)
+    {
+        // The payload is copied into the retransmission queue before the frame is rebuilt
+        if (sendTcpMessage(ether, s, PSH | ACK, data, size))
+        {
+            s->ackNeeded = false;
+            c->txBytes += size;
+            c->txSegments++;
+        }
+        else
+        {
+            c->drops++;
+        }
+    }
+}
+
+// Determines whether a UDP datagram is addressed to the test service
+bool isPerfUdp(etherHeader *ether)
+{
+    udpHeader *udp = (udpHeader*)(getUdpData(ether) - sizeof(udpHeader));
+    uint16_t port = ntohs(udp->destPort);
+
+    return perfEnabled && (port == PERF_ECHO_PORT || port == PERF_DISCARD_PORT);
+}
+
+// Counts a datagram and echoes it back on port 7
+void processPerfUdp(etherHeader *ether)
+{
+    perfCounters *c = &perfStats[PERF_UDP];
+    udpHeader *udp = (udpHeader*)(getUdpData(ether) - sizeof(udpHeader));
+    uint16_t size = ntohs(udp->length) - sizeof(udpHeader);
+    socket s;
+
+    countPerfReceived(c, size);
+
+    if (ntohs(udp->destPort) == PERF_ECHO_PORT)
+    {
+        // sendUdpMessage copies byte by byte from the front, so the payload
+        // does not move when the reply is built in the same frame
+        getSocketInfoFromUdpPacket(ether, &s);
+        sendUdpMessage(ether, s, udp->data, size);
+        c->txBytes += size;
+        c->txSegments++;
+    }
+}
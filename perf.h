@@ -0,0 +1,60 @@
+// Throughput Test Service
+// Echo (RFC 862) and discard (RFC 863) endpoints over TCP and UDP
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: -
+// Target uC:       -
+// System Clock:    -
+
+// Hardware configuration:
+// -
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#ifndef PERF_H_
+#define PERF_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ip.h"
+#include "socket.h"
+
+#define PERF_ECHO_PORT 7
+#define PERF_DISCARD_PORT 9
+
+#define PERF_TCP 0
+#define PERF_UDP 1
+
+typedef struct _perfCounters
+{
+    uint32_t rxBytes;
+    uint32_t rxSegments;
+    uint32_t txBytes;
+    uint32_t txSegments;
+    uint32_t drops;                 // Echoes that found no room to be sent
+    uint32_t firstSecond;           // Uptime of the first and last counted segment
+    uint32_t lastSecond;
+} perfCounters;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+void initPerf(void);
+void callbackPerfTimer(void);
+void enablePerf(void);
+void disablePerf(void);
+bool isPerfEnabled(void);
+void resetPerfCounters(void);
+perfCounters* getPerfCounters(uint8_t mode);
+uint32_t getPerfElapsedSeconds(uint8_t mode);
+
+bool isPerfUdp(etherHeader *ether);
+void processPerfUdp(etherHeader *ether);
+
+#endif
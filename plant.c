@@ -63,6 +63,7 @@
 // DHT22 Temperature and Humidity Sensor
 #define DH_OUT_PIN PORTD, 2     // Data output pin
 #define DH_WAIT_TIME_SECONDS 2  // Time in seconds to wait for sensor to be ready
+#define DH_FAILED_READS 3       // Failed reads in a row before the sensor is reported failed
 
 // Capacitive Soil Moisture Sensor
 #define SM_AOUT_PIN PORTE, 0    // Analog output pin
@@ -79,11 +80,13 @@
 
 // Plant
 #define PLANT_SAMPLE_TIME_S 4   // Sample time in seconds
+#define PLANT_MOISTURE_TIME_S 1 // Soil moisture is cheap to read and drives the dry alarm
 
 // Variables ------------------------------------------------------------------
 
 // DHT22 Temperature and Humidity Sensor
 bool DHT22ready = true;     // Flag for sensor readiness
+uint8_t DHT22failures = 0;  // Failed reads in a row
 
 // Capacitive Soil Moisture Sensor
 const uint16_t moistureMin = 1400;  // Minimum value from the ADC (Water)
@@ -95,6 +98,7 @@ const uint16_t hx711Scaler = 420;   // Raw ADC to volume scale (div) value lol
 
 // Plant
 bool samplePlant = true;    // Flag indicating plant can be sampled
+uint32_t moistureSampledAt = 0xFFFFFFFF;    // Uptime of the last soil moisture sample
 
 // Structures -----------------------------------------------------------------
 
@@ -333,7 +337,18 @@ void getDHT22TempAndHum(uint8_t *temp, uint8_t *hum)
     {
         *hum = data.hum / 10;
         *temp = data.temp / 10;
+        DHT22failures = 0;
     }
+    else if (DHT22failures < DH_FAILED_READS)
+    {
+        DHT22failures++;
+    }
+}
+
+// Returns true once the DHT22 has failed DH_FAILED_READS reads in a row
+bool isDHT22Failed(void)
+{
+    return DHT22failures >= DH_FAILED_READS;
 }
 
 // Capacitive Soil Moisture Sensor
@@ -361,15 +376,38 @@ uint16_t getSoilMoisture(void)
     static uint32_t sum = 0;
     static uint8_t i = 0;
     static uint16_t moisture_avg = 0;
+    static bool primed = false;
 
     // Stores raw value from the ADC
     uint16_t raw = readAdc0Ss3();
     // Return value with calculated percentage
     uint16_t moisture = 0;
 
+    // Keeps readings past the calibration points at 0% and 100%
+    if (raw > moistureMax)
+    {
+        raw = moistureMax;
+    }
+    if (raw < moistureMin)
+    {
+        raw = moistureMin;
+    }
+
     // Calculates percentage: (1 - (raw - min) / (max - min)) * 100
     moisture = ((moistureMax - raw) * 100) / (moistureMax - moistureMin);
 
+    // Fills the buffer with the first reading, so the average does not start near 0%
+    if (!primed)
+    {
+        for (i = 0; i < SM_AVG_BUFF_SIZE; i++)
+        {
+            buff[i] = moisture;
+        }
+        sum = moisture * SM_AVG_BUFF_SIZE;
+        i = 0;
+        primed = true;
+    }
+
     // Circular buffer for averaging
     sum -= buff[i];
     sum += moisture;
@@ -466,7 +504,13 @@ uint16_t getHX711Volume(void)
 {
     // Gets data from HX711 and calculates the current volume
     uint32_t raw = readHX711Data();
-    uint16_t volume = ((raw - hx711Base) / hx711Scaler);
+    uint16_t volume = 0;
+
+    // Below the base an empty reservoir would wrap around to a large volume
+    if (raw > hx711Base)
+    {
+        volume = (raw - hx711Base) / hx711Scaler;
+    }
 
     return volume;
 }
@@ -500,14 +544,20 @@ void callbackSamplePlant(void)
 }
 
 // Gets and updates the plant data every PLANT_SAMPLE_TIME_S seconds
+// Soil moisture every PLANT_MOISTURE_TIME_S seconds
 void getPlantData(uint16_t *lux, uint8_t *temp, uint8_t *hum, uint16_t *moist, uint16_t *volume)
 {
+    if (getUptime() - moistureSampledAt >= PLANT_MOISTURE_TIME_S)
+    {
+        *moist = getSoilMoisture();
+        moistureSampledAt = getUptime();
+    }
+
     if (samplePlant)
     {
         // Updates plant data for each sensor
         *lux = getBH1750Lux();
         getDHT22TempAndHum(temp, hum);
-        *moist = getSoilMoisture();
         *volume = getHX711Volume();
 
         // Starts timer for next sample
@@ -30,6 +30,7 @@
 // Libraries ------------------------------------------------------------------
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "plant.h"
 
 // Defines --------------------------------------------------------------------
@@ -48,6 +49,7 @@ uint32_t getHX711Raw(void);
 // Plant
 void initPlant(void);
 void getPlantData(uint16_t *lux, uint8_t *temp, uint8_t *hum, uint16_t *moist, uint16_t *volume);
+bool isDHT22Failed(void);
 
 #endif
 
@@ -0,0 +1,88 @@
+// Publish Policy
+// Decides when a reading is worth publishing: deadband, minimum interval and heartbeat
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: -
+// Target uC:       -
+// System Clock:    -
+
+// Hardware configuration:
+// -
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+// A reading is published when it has moved past the deadband from the last published
+// value, but no sooner than minInterval after the last publish. When a value holds
+// still it is still published every heartbeat, so the backend can tell a stable plant
+// from a silent one. Stable plants then cost a message per heartbeat instead of one
+// per sample.
+
+#include "policy.h"
+#include "timer.h"
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+void initPublishPolicy(publishPolicy *p, uint8_t mode, uint16_t deadband, uint16_t minInterval, uint16_t heartbeat)
+{
+    p->mode = mode;
+    p->deadband = deadband;
+    p->minInterval = minInterval;
+    p->heartbeat = heartbeat;
+    resetPublishPolicy(p);
+}
+
+// The next reading is published whatever its value
+void resetPublishPolicy(publishPolicy *p)
+{
+    p->lastValue = 0;
+    p->lastTime = 0;
+    p->published = false;
+}
+
+// Determines whether value moved past the deadband from the last published value
+bool isPublishChanged(publishPolicy *p, uint16_t value)
+{
+    uint32_t delta = (value > p->lastValue) ? value - p->lastValue : p->lastValue - value;
+
+    if (!p->published)
+    {
+        return true;
+    }
+    if (p->mode == POLICY_PERCENT)
+    {
+        // A change away from 0 always counts
+        return delta > 0 && delta * 100 >= (uint32_t)p->deadband * p->lastValue;
+    }
+    return delta > 0 && delta >= p->deadband;
+}
+
+// Determines whether value should be published now
+bool isPublishDue(publishPolicy *p, uint16_t value)
+{
+    uint32_t elapsed = getUptime() - p->lastTime;
+
+    if (!p->published)
+    {
+        return true;
+    }
+    if (elapsed < p->minInterval)
+    {
+        return false;
+    }
+    return isPublishChanged(p, value) || (p->heartbeat != 0 && elapsed >= p->heartbeat);
+}
+
+// Call once value has been handed to the transport
+void setPublished(publishPolicy *p, uint16_t value)
+{
+    p->lastValue = value;
+    p->lastTime = getUptime();
+    p->published = true;
+}
@@ -0,0 +1,49 @@
+// Publish Policy
+// Decides when a reading is worth publishing: deadband, minimum interval and heartbeat
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: -
+// Target uC:       -
+// System Clock:    -
+
+// Hardware configuration:
+// -
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#ifndef POLICY_H_
+#define POLICY_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Deadband modes
+#define POLICY_ABSOLUTE 0               // In the units of the value
+#define POLICY_PERCENT  1               // Percent of the last published value
+
+typedef struct _publishPolicy
+{
+    uint8_t mode;
+    uint16_t deadband;
+    uint16_t minInterval;           // Seconds between publishes at least, even for large changes
+    uint16_t heartbeat;             // Seconds after which it is published unchanged, 0 for never
+    uint16_t lastValue;             // Last published
+    uint32_t lastTime;              // Uptime of the last publish
+    bool published;                 // False until the first publish, which is always due
+} publishPolicy;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+void initPublishPolicy(publishPolicy *p, uint8_t mode, uint16_t deadband, uint16_t minInterval, uint16_t heartbeat);
+void resetPublishPolicy(publishPolicy *p);
+bool isPublishDue(publishPolicy *p, uint16_t value);
+void setPublished(publishPolicy *p, uint16_t value);
+
+#endif
@@ -17,13 +17,12 @@
 //-----------------------------------------------------------------------------
 
 #include <stdio.h>
+#include <string.h>
 #include "arp.h"
 #include "ip.h"
 #include "udp.h"
 #include "tcp.h"
 
-#define MAX_SOCKETS 10
-
 // ------------------------------------------------------------------------------
 //  Globals
 // ------------------------------------------------------------------------------
@@ -43,7 +42,10 @@ void initSockets(void)
 {
     uint8_t i;
     for (i = 0; i < MAX_SOCKETS; i++)
+    {
         sockets[i].state = TCP_CLOSED;
+        sockets[i].inUse = false;
+    }
 }
 
 socket * newSocket(void)
@@ -53,9 +55,15 @@ socket * newSocket(void)
     bool foundUnused = false;
     while (i < MAX_SOCKETS && !foundUnused)
     {
-        foundUnused = sockets[i].state == TCP_CLOSED;
+        foundUnused = !sockets[i].inUse;
         if (foundUnused)
+        {
             s = &sockets[i];
+            memset(s, 0, sizeof(socket));
+            s->state = TCP_CLOSED;
+            s->mss = TCP_DEFAULT_MSS;
+            s->inUse = true;
+        }
         i++;
     }
     return s;
@@ -69,11 +77,58 @@ void deleteSocket(socket *s)
     {
         foundMatch = &sockets[i] == s;
         if (foundMatch)
+        {
             sockets[i].state = TCP_CLOSED;
+            sockets[i].inUse = false;
+        }
         i++;
     }
 }
 
+// Returns the socket at index in the pool or NULL if unused
+socket * getSocket(uint8_t index)
+{
+    if (index < MAX_SOCKETS && sockets[index].inUse)
+        return &sockets[index];
+    return NULL;
+}
+
+// Finds the open socket a received TCP segment belongs to
+socket * findTcpSocket(etherHeader *ether)
+{
+    ipHeader *ip = (ipHeader*)ether->data;
+    uint8_t ipHeaderLength = ip->size * 4;
+    tcpHeader* tcp = (tcpHeader*)((uint8_t*)ip + ipHeaderLength);
+    socket *s;
+    uint8_t i, j;
+    bool match;
+    for (i = 0; i < MAX_SOCKETS; i++)
+    {
+        s = &sockets[i];
+        match = s->inUse && s->state != TCP_CLOSED
+             && s->localPort == ntohs(tcp->destPort)
+             && s->remotePort == ntohs(tcp->sourcePort);
+        for (j = 0; match && j < IP_ADD_LENGTH; j++)
+            match = s->remoteIpAddress[j] == ip->sourceIp[j];
+        if (match)
+            return s;
+    }
+    return NULL;
+}
+
+// Registers the event handlers of a TCP connection
+// callbacks is kept by reference, context is handed back through getSocketContext
+void setSocketCallbacks(socket *s, const socketCallbacks *callbacks, void *context)
+{
+    s->callbacks = callbacks;
+    s->context = context;
+}
+
+void* getSocketContext(socket *s)
+{
+    return s->context;
+}
+
 // Get socket information from a received ARP response message
 void getSocketInfoFromArpResponse(etherHeader *ether, socket *s)
 {
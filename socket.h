@@ -23,6 +23,23 @@
 #include <stdbool.h>
 #include "ip.h"
 
+struct _socket;
+
+// Event callbacks, see setSocketCallbacks
+// Received data points into the frame and is only valid until the handler builds a message
+typedef void (*_socketCallback)(etherHeader *ether, struct _socket *s);
+typedef void (*_socketDataCallback)(etherHeader *ether, struct _socket *s, uint8_t data[], uint16_t size);
+typedef void (*_socketAckedCallback)(etherHeader *ether, struct _socket *s, uint32_t acked);
+typedef void (*_socketClosedCallback)(struct _socket *s);
+
+typedef struct _socketCallbacks
+{
+    _socketCallback connected;      // Handshake complete
+    _socketDataCallback received;   // In-order data arrived
+    _socketAckedCallback acked;     // Peer acknowledged sent data
+    _socketClosedCallback closed;   // Connection is gone or could not be made, no frame to send with
+} socketCallbacks;
+
 // UDP/TCP socket
 typedef struct _socket
 {
@@ -32,9 +49,34 @@ typedef struct _socket
     uint16_t localPort;
     uint32_t sequenceNumber;
     uint32_t acknowledgementNumber;
+    uint16_t mss;                   // Largest segment the peer accepts
     uint8_t  state;
+    bool     inUse;
+    bool     passive;               // Accepted on a listening port, freed on close
+    bool     arpNeeded;
+    bool     synNeeded;
+    bool     ackNeeded;
+    bool     finNeeded;
+    uint8_t  timer;                 // Seconds until timeout, 0 when stopped
+    uint8_t  retries;
+    uint32_t sendUnacked;           // Oldest sequence number not yet acknowledged
+    uint16_t remoteWindow;
+    uint8_t  rto;                   // Retransmission timeout in seconds
+    uint8_t  dupAcks;
+    uint32_t recover;               // Highest sequence number sent when recovery began
+    bool     fastRecovery;
+    bool     retransmitNeeded;
+    bool     persisting;            // Data waits on a zero window, the timer sends probes
+    bool     probeNeeded;
+    uint32_t cwnd;                  // Congestion window in bytes
+    uint32_t ssthresh;              // Slow start threshold in bytes
+    uint16_t receivedLength;        // In-order payload bytes of the segment just processed
+    const socketCallbacks *callbacks;
+    void     *context;              // Owned by the application
 } socket;
 
+#define MAX_SOCKETS 10
+
 //-----------------------------------------------------------------------------
 // Subroutines
 //-----------------------------------------------------------------------------
@@ -42,6 +84,10 @@ typedef struct _socket
 void initSockets();
 socket * newSocket();
 void deleteSocket(socket *s);
+socket * getSocket(uint8_t index);
+socket * findTcpSocket(etherHeader *ether);
+void setSocketCallbacks(socket *s, const socketCallbacks *callbacks, void *context);
+void* getSocketContext(socket *s);
 //void getSocketInfoFromArpResponse(etherHeader *ether, socket *s);
 void getSocketInfoFromArpResponse(etherHeader *ether, socket *s);
 void getSocketInfoFromUdpPacket(etherHeader *ether, socket *s);
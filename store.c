@@ -0,0 +1,171 @@
+// Store-and-Forward Queue
+// Buffers outbound telemetry while the broker is unreachable
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: EK-TM4C123GXL
+// Target uC:       TM4C123GH6PM
+// System Clock:    -
+
+// Hardware configuration:
+// Internal EEPROM
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+// Each record is one 32-bit word, topic in bits 23:16 and value in bits 15:0, so it
+// maps onto a single EEPROM word. When the RAM ring fills its oldest record moves to
+// the EEPROM ring, which therefore always holds the oldest part of the queue. Records
+// are drained from EEPROM first, then RAM, so they leave in the order they were stored.
+// When both are full the oldest record is dropped.
+// The queue positions live in RAM, records in EEPROM do not survive a reset.
+
+#include <stdio.h>
+#include "store.h"
+#include "eeprom.h"
+#include "mqtt.h"
+
+#define STORE_RECORD(topic, value) (((uint32_t)(topic) << 16) | (value))
+#define STORE_TOPIC(record) (((record) >> 16) & 0xFF)
+#define STORE_VALUE(record) ((record) & 0xFFFF)
+
+// ------------------------------------------------------------------------------
+//  Globals
+// ------------------------------------------------------------------------------
+
+uint32_t storeRam[STORE_RAM_RECORDS];
+uint16_t storeRamHead = 0;
+uint16_t storeRamCount = 0;
+uint16_t storeEepromHead = 0;
+uint16_t storeEepromCount = 0;
+uint32_t storeDrops = 0;
+
+uint8_t storeDrainRate = STORE_DRAIN_RATE;
+uint8_t storeDrainBudget = 0;
+// Seconds counted by the timer ISR and those drainStore has refilled the budget for
+volatile uint8_t storeTicks = 0;
+uint8_t storeTicksDone = 0;
+_storeSendCallback storeSend = NULL;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+// Counts seconds for the drain budget, called from the shared 1 second timer
+void callbackStoreTimer(void)
+{
+    storeTicks++;
+}
+
+void initStore(_storeSendCallback callback)
+{
+    storeSend = callback;
+}
+
+// Moves the oldest RAM record to the back of the EEPROM ring
+void spillStore(void)
+{
+    if (storeEepromCount == STORE_EEPROM_RECORDS)
+    {
+        storeEepromHead = (storeEepromHead + 1) % STORE_EEPROM_RECORDS;
+        storeEepromCount--;
+        storeDrops++;
+    }
+    writeEeprom(STORE_EEPROM_BASE + (storeEepromHead + storeEepromCount) % STORE_EEPROM_RECORDS,
+                storeRam[storeRamHead]);
+    storeEepromCount++;
+    storeRamHead = (storeRamHead + 1) % STORE_RAM_RECORDS;
+    storeRamCount--;
+}
+
+// Adds a sample to the back of the queue
+void storeTelemetry(uint8_t topic, uint16_t value)
+{
+    if (storeRamCount == STORE_RAM_RECORDS)
+    {
+        spillStore();
+    }
+    storeRam[(storeRamHead + storeRamCount) % STORE_RAM_RECORDS] = STORE_RECORD(topic, value);
+    storeRamCount++;
+}
+
+// Sends queued records in order while connected, at most the drain rate per second
+// Stops early when the transport cannot take more, the record is retried next time
+// Records drained together are batched into one TCP message
+void drainStore(etherHeader *ether, socket *s)
+{
+    uint32_t record;
+
+    // The budget is refilled once a second, only here so the ISR never touches it
+    if (storeTicksDone != storeTicks)
+    {
+        storeTicksDone = storeTicks;
+        storeDrainBudget = storeDrainRate;
+    }
+
+    if (!isMqttConAcked() || storeSend == NULL || storeDrainBudget == 0 || (storeEepromCount + storeRamCount) == 0)
+    {
+        return;
+    }
+    startMqttBatch();
+    while (storeDrainBudget > 0 && (storeEepromCount + storeRamCount) > 0)
+    {
+        if (storeEepromCount > 0)
+        {
+            record = readEeprom(STORE_EEPROM_BASE + storeEepromHead);
+        }
+        else
+        {
+            record = storeRam[storeRamHead];
+        }
+
+        if (!storeSend(ether, s, STORE_TOPIC(record), STORE_VALUE(record)))
+        {
+            break;
+        }
+
+        if (storeEepromCount > 0)
+        {
+            storeEepromHead = (storeEepromHead + 1) % STORE_EEPROM_RECORDS;
+            storeEepromCount--;
+        }
+        else
+        {
+            storeRamHead = (storeRamHead + 1) % STORE_RAM_RECORDS;
+            storeRamCount--;
+        }
+        storeDrainBudget--;
+    }
+    endMqttBatch(ether, s);
+}
+
+void setStoreDrainRate(uint8_t recordsPerSecond)
+{
+    storeDrainRate = recordsPerSecond;
+}
+
+uint8_t getStoreDrainRate(void)
+{
+    return storeDrainRate;
+}
+
+// Records waiting to be sent
+uint16_t getStoreCount(void)
+{
+    return storeEepromCount + storeRamCount;
+}
+
+// Records waiting in EEPROM
+uint16_t getStoreSpilledCount(void)
+{
+    return storeEepromCount;
+}
+
+// Records lost because both rings were full
+uint32_t getStoreDropCount(void)
+{
+    return storeDrops;
+}
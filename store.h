@@ -0,0 +1,51 @@
+// Store-and-Forward Queue
+// Buffers outbound telemetry while the broker is unreachable
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: EK-TM4C123GXL
+// Target uC:       TM4C123GH6PM
+// System Clock:    -
+
+// Hardware configuration:
+// Internal EEPROM
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#ifndef STORE_H_
+#define STORE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ip.h"
+#include "socket.h"
+
+// Newest records stay in RAM, older ones spill to EEPROM words
+// STORE_EEPROM_BASE..+STORE_EEPROM_RECORDS, clear of the configuration words
+#define STORE_RAM_RECORDS 32
+#define STORE_EEPROM_BASE 64
+#define STORE_EEPROM_RECORDS 256
+#define STORE_DRAIN_RATE 5              // Records per second once connected
+
+// Hands one record to the transport, returns false if it cannot take it yet
+typedef bool (*_storeSendCallback)(etherHeader *ether, socket *s, uint8_t topic, uint16_t value);
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+void initStore(_storeSendCallback callback);
+void callbackStoreTimer(void);
+void storeTelemetry(uint8_t topic, uint16_t value);
+void drainStore(etherHeader *ether, socket *s);
+void setStoreDrainRate(uint8_t recordsPerSecond);
+uint8_t getStoreDrainRate(void);
+uint16_t getStoreCount(void);
+uint16_t getStoreSpilledCount(void);
+uint32_t getStoreDropCount(void);
+
+#endif
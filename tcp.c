@@ -27,18 +27,32 @@
 
 #define MAX_TCP_PORTS 4
 
+// Sequence number comparisons that survive wraparound
+#define SEQ_LT(a, b)  ((int32_t)((a) - (b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t)((a) - (b)) <= 0)
+#define SEQ_GT(a, b)  ((int32_t)((a) - (b)) > 0)
+
 //-----------------------------------------------------------------------------
 //  Globals
 //-----------------------------------------------------------------------------
 
 uint16_t tcpPorts[MAX_TCP_PORTS];
+const socketCallbacks *tcpPortCallbacks[MAX_TCP_PORTS];
+void *tcpPortContexts[MAX_TCP_PORTS];
 uint8_t tcpPortCount = 0;
-uint8_t tcpState[MAX_TCP_PORTS];
 
-bool synNeeded = false;
-bool ackNeeded = false;
-bool arpNeeded = false;
-bool finNeeded = false;
+// Seconds counted by the timer ISR and those already run by sendTcpPendingMessages
+// Each side only writes its own counter, so no tick is lost to a read-modify-write race
+volatile uint8_t tcpTicks = 0;
+uint8_t tcpTicksDone = 0;
+
+// Retransmission queue, segments in the order they were sent
+uint8_t tcpTxBuffer[TCP_TX_BUFFER_SIZE];
+uint16_t tcpTxHead = 0;
+uint16_t tcpTxTail = 0;
+tcpSegment tcpSegments[TCP_TX_SEGMENTS];
+uint8_t tcpSegmentHead = 0;
+uint8_t tcpSegmentCount = 0;
 
 //-----------------------------------------------------------------------------
 //  Structures
@@ -48,45 +62,564 @@ bool finNeeded = false;
 // Subroutines
 //-----------------------------------------------------------------------------
 
-void sendAck(void)
+// Counts seconds for processTcpTimers, called from the shared 1 second timer
+void callbackTcpTimer(void)
 {
-    ackNeeded = true;
+    tcpTicks++;
 }
 
-void sendTcpFin(void)
+void sendAck(socket *s)
 {
-    finNeeded = true;
+    s->ackNeeded = true;
 }
 
-void sendTcpArpRequest(void)
+void sendTcpFin(socket *s)
 {
-    arpNeeded = true;
+    s->finNeeded = true;
 }
 
 // Set TCP state
-void setTcpState(uint8_t instance, uint8_t state)
+void setTcpState(socket *s, uint8_t state)
 {
-    tcpState[instance] = state;
+    s->state = state;
 }
 
 // Get TCP state
-uint8_t getTcpState(uint8_t instance)
+uint8_t getTcpState(socket *s)
+{
+    return s->state;
+}
+
+// Our FIN is out, it takes the sequence number just below sequenceNumber
+bool isTcpFinSent(socket *s)
+{
+    return getTcpState(s) == TCP_FIN_WAIT_1 || getTcpState(s) == TCP_FIN_WAIT_2 || getTcpState(s) == TCP_CLOSING
+           || getTcpState(s) == TCP_LAST_ACK || getTcpState(s) == TCP_TIME_WAIT;
+}
+
+// Reclaims ring space from the front of the queue once those segments are released
+void compactTcpSegments(void)
+{
+    while (tcpSegmentCount > 0 && !tcpSegments[tcpSegmentHead].inUse)
+    {
+        tcpSegmentHead = (tcpSegmentHead + 1) % TCP_TX_SEGMENTS;
+        tcpSegmentCount--;
+    }
+    if (tcpSegmentCount > 0)
+    {
+        tcpTxHead = tcpSegments[tcpSegmentHead].offset;
+    }
+    else
+    {
+        tcpTxHead = 0;
+        tcpTxTail = 0;
+    }
+}
+
+// Adds a segment to the back of the queue, NULL if the ring or table is full
+tcpSegment* allocTcpSegment(socket *s, uint32_t sequenceNumber, uint16_t length)
+{
+    tcpSegment *seg;
+    uint16_t offset;
+
+    if (tcpSegmentCount == TCP_TX_SEGMENTS || length == 0)
+    {
+        return NULL;
+    }
+
+    // Live bytes are [head, tail) unless the ring has wrapped
+    if (tcpSegmentCount == 0 || tcpTxTail > tcpTxHead)
+    {
+        if (TCP_TX_BUFFER_SIZE - tcpTxTail >= length)
+        {
+            offset = tcpTxTail;
+        }
+        else if (length <= tcpTxHead)
+        {
+            offset = 0;
+        }
+        else
+        {
+            return NULL;
+        }
+    }
+    else if (tcpTxHead - tcpTxTail >= length)
+    {
+        offset = tcpTxTail;
+    }
+    else
+    {
+        return NULL;
+    }
+
+    seg = &tcpSegments[(tcpSegmentHead + tcpSegmentCount) % TCP_TX_SEGMENTS];
+    tcpSegmentCount++;
+    seg->s = s;
+    seg->sequenceNumber = sequenceNumber;
+    seg->offset = offset;
+    seg->length = length;
+    seg->inUse = true;
+    seg->sent = false;
+    tcpTxTail = offset + length;
+
+    return seg;
+}
+
+// Undoes the most recent allocTcpSegment
+void freeNewestTcpSegment(void)
+{
+    tcpSegment *seg;
+
+    tcpSegmentCount--;
+    if (tcpSegmentCount > 0)
+    {
+        seg = &tcpSegments[(tcpSegmentHead + tcpSegmentCount - 1) % TCP_TX_SEGMENTS];
+        tcpTxTail = seg->offset + seg->length;
+    }
+    compactTcpSegments();
+}
+
+// Largest payload for one segment on this connection
+uint16_t getTcpSendMss(socket *s)
+{
+    if (s->mss == 0 || s->mss > TCP_MSS)
+    {
+        return TCP_MSS;
+    }
+    return s->mss;
+}
+
+// Newest segment of a socket, sent or not
+tcpSegment* getLastTcpSegment(socket *s)
+{
+    uint8_t i;
+    tcpSegment *seg;
+
+    for (i = tcpSegmentCount; i > 0; i--)
+    {
+        seg = &tcpSegments[(tcpSegmentHead + i - 1) % TCP_TX_SEGMENTS];
+        if (seg->inUse && seg->s == s)
+        {
+            return seg;
+        }
+    }
+    return NULL;
+}
+
+// Copies data into the queue as MSS sized segments following whatever is already queued
+// Either all of it fits or nothing is queued
+bool queueTcpData(socket *s, uint8_t data[], uint16_t dataSize)
+{
+    uint16_t mss = getTcpSendMss(s);
+    tcpSegment *last = getLastTcpSegment(s);
+    uint32_t sequenceNumber = (last != NULL) ? last->sequenceNumber + last->length : s->sequenceNumber;
+    uint16_t length;
+    uint8_t count = 0;
+    tcpSegment *seg;
+
+    while (dataSize > 0)
+    {
+        length = (dataSize > mss) ? mss : dataSize;
+        seg = allocTcpSegment(s, sequenceNumber, length);
+        if (seg == NULL)
+        {
+            while (count > 0)
+            {
+                freeNewestTcpSegment();
+                count--;
+            }
+            return false;
+        }
+        memcpy(&tcpTxBuffer[seg->offset], data, length);
+        data += length;
+        dataSize -= length;
+        sequenceNumber += length;
+        count++;
+    }
+    return true;
+}
+
+// Releases segments the peer has acknowledged
+void freeAckedTcpSegments(socket *s)
+{
+    uint8_t i;
+    tcpSegment *seg;
+
+    for (i = 0; i < TCP_TX_SEGMENTS; i++)
+    {
+        seg = &tcpSegments[i];
+        if (seg->inUse && seg->s == s && SEQ_LEQ(seg->sequenceNumber + seg->length, s->sendUnacked))
+        {
+            seg->inUse = false;
+        }
+    }
+    compactTcpSegments();
+}
+
+// Drops everything queued for a socket that is closing
+void flushTcpSegments(socket *s)
+{
+    uint8_t i;
+
+    for (i = 0; i < TCP_TX_SEGMENTS; i++)
+    {
+        if (tcpSegments[i].s == s)
+        {
+            tcpSegments[i].inUse = false;
+        }
+    }
+    compactTcpSegments();
+}
+
+// Oldest unacknowledged segment of a socket
+tcpSegment* getFirstTcpSegment(socket *s)
+{
+    uint8_t i;
+    tcpSegment *seg;
+
+    for (i = 0; i < tcpSegmentCount; i++)
+    {
+        seg = &tcpSegments[(tcpSegmentHead + i) % TCP_TX_SEGMENTS];
+        if (seg->inUse && seg->s == s)
+        {
+            return seg;
+        }
+    }
+    return NULL;
+}
+
+// Starts the retransmission timer if it is not already running
+void startTcpRetransmitTimer(socket *s)
+{
+    if (s->timer == 0)
+    {
+        s->timer = s->rto;
+    }
+}
+
+// Bytes sent but not yet acknowledged
+// Segments waiting to be resent after a timeout are not in flight, the FIN is not counted
+uint32_t getTcpFlightSize(socket *s)
+{
+    uint8_t i;
+    tcpSegment *seg;
+    uint32_t flight = 0;
+
+    for (i = 0; i < tcpSegmentCount; i++)
+    {
+        seg = &tcpSegments[(tcpSegmentHead + i) % TCP_TX_SEGMENTS];
+        if (seg->inUse && seg->s == s && seg->sent)
+        {
+            flight += seg->sequenceNumber + seg->length - (SEQ_GT(s->sendUnacked, seg->sequenceNumber) ? s->sendUnacked : seg->sequenceNumber);
+        }
+    }
+    return flight;
+}
+
+// After a timeout everything unacknowledged goes out again from the oldest segment
+// (go-back-N), as far as the congestion window allows
+void resendTcpSegments(socket *s)
+{
+    uint8_t i;
+    tcpSegment *seg;
+
+    for (i = 0; i < tcpSegmentCount; i++)
+    {
+        seg = &tcpSegments[(tcpSegmentHead + i) % TCP_TX_SEGMENTS];
+        if (seg->inUse && seg->s == s)
+        {
+            seg->sent = false;
+        }
+    }
+}
+
+// Halves the window after a loss, never below TCP_MIN_SSTHRESH segments
+void reduceTcpSsthresh(socket *s)
+{
+    uint32_t mss = getTcpSendMss(s);
+
+    s->ssthresh = getTcpFlightSize(s) / 2;
+    if (s->ssthresh < TCP_MIN_SSTHRESH * mss)
+    {
+        s->ssthresh = TCP_MIN_SSTHRESH * mss;
+    }
+}
+
+// Opens the congestion window for newly acknowledged data
+// Slow start adds up to one MSS per ACK, congestion avoidance about one MSS per round trip
+void growTcpCwnd(socket *s, uint32_t acked)
+{
+    uint32_t mss = getTcpSendMss(s);
+    uint32_t increase;
+
+    if (s->cwnd < s->ssthresh)
+    {
+        increase = (acked < mss) ? acked : mss;
+    }
+    else
+    {
+        increase = (mss * mss) / s->cwnd;
+        if (increase == 0)
+        {
+            increase = 1;
+        }
+    }
+    // Nothing is gained by growing past what the queue can hold
+    if (s->cwnd < TCP_TX_BUFFER_SIZE)
+    {
+        s->cwnd += increase;
+    }
+}
+
+// Sets up send state once the handshake completes
+void initTcpSendState(socket *s, etherHeader *ether)
+{
+    tcpHeader *tcp = getTcpHeaderPtr(ether);
+
+    s->sendUnacked = s->sequenceNumber;
+    s->remoteWindow = ntohs(tcp->windowSize);
+    s->rto = TCP_RTO_S;
+    s->dupAcks = 0;
+    s->fastRecovery = false;
+    s->retransmitNeeded = false;
+    s->persisting = false;
+    s->probeNeeded = false;
+    s->cwnd = TCP_INITIAL_WINDOW * getTcpSendMss(s);
+    s->ssthresh = 0xFFFFFFFF;
+}
+
+// Releases acknowledged data, counts duplicate ACKs and adjusts the congestion window
+// The third duplicate fast retransmits the first unacknowledged segment. During recovery
+// a partial ACK means the next segment was lost too and it is resent right away (NewReno).
+// Returns the number of newly acknowledged bytes
+uint32_t processTcpAck(etherHeader *ether, socket *s)
+{
+    tcpHeader *tcp = getTcpHeaderPtr(ether);
+    uint32_t ack = ntohl(tcp->acknowledgementNumber);
+    uint16_t window = ntohs(tcp->windowSize);
+    uint32_t mss = getTcpSendMss(s);
+    uint32_t acked = 0;
+
+    if (SEQ_GT(ack, s->sendUnacked) && SEQ_LEQ(ack, s->sequenceNumber))
+    {
+        acked = ack - s->sendUnacked;
+        s->sendUnacked = ack;
+        // The FIN takes up a sequence number but is not data
+        if (isTcpFinSent(s) && ack == s->sequenceNumber)
+        {
+            acked--;
+        }
+        freeAckedTcpSegments(s);
+        s->dupAcks = 0;
+        s->retries = 0;
+        s->rto = TCP_RTO_S;
+        s->timer = (s->sendUnacked != s->sequenceNumber) ? s->rto : 0;
+
+        if (s->fastRecovery)
+        {
+            if (SEQ_LT(ack, s->recover))
+            {
+                // Partial ACK, deflate by what left the network and resend the next hole
+                s->cwnd = (s->cwnd > acked) ? s->cwnd - acked : 0;
+                s->cwnd += mss;
+                s->retransmitNeeded = true;
+            }
+            else
+            {
+                // Full ACK, continue in congestion avoidance from the halved window
+                s->fastRecovery = false;
+                s->cwnd = s->ssthresh;
+            }
+        }
+        else
+        {
+            growTcpCwnd(s, acked);
+        }
+    }
+    else if (ack == s->sendUnacked && s->sendUnacked != s->sequenceNumber
+             && getTcpDataLength(ether) == 0 && !isTcpSyn(ether) && !isTcpFin(ether)
+             && window == s->remoteWindow)
+    {
+        s->dupAcks++;
+        if (s->dupAcks == TCP_DUP_ACK_THRESHOLD && !s->fastRecovery)
+        {
+            reduceTcpSsthresh(s);
+            s->cwnd = s->ssthresh + TCP_DUP_ACK_THRESHOLD * mss;
+            s->fastRecovery = true;
+            s->recover = s->sequenceNumber;
+            s->retransmitNeeded = true;
+        }
+        else if (s->fastRecovery)
+        {
+            // Each duplicate means a segment has left the network
+            s->cwnd += mss;
+        }
+    }
+
+    s->remoteWindow = window;
+
+    // Window opened, queued data goes out again from sendTcpQueuedSegments
+    if (s->persisting && window > 0)
+    {
+        s->persisting = false;
+        s->rto = TCP_RTO_S;
+        s->timer = (s->sendUnacked != s->sequenceNumber) ? s->rto : 0;
+    }
+    return acked;
+}
+
+void restartTcpStateMachine(socket *s)
 {
-    return tcpState[instance];
+    s->synNeeded = false;
+    s->ackNeeded = false;
+    s->arpNeeded = false;
+    s->finNeeded = false;
+    s->timer = 0;
+    s->retries = 0;
+    s->retransmitNeeded = false;
+    s->persisting = false;
+    s->probeNeeded = false;
+    flushTcpSegments(s);
+    setTcpState(s, TCP_CLOSED);
+}
+
+// Closes the connection, sockets accepted on a listening port go back to the pool
+void closeTcpSocket(socket *s)
+{
+    restartTcpStateMachine(s);
+    if (s->callbacks != NULL && s->callbacks->closed != NULL)
+    {
+        s->callbacks->closed(s);
+    }
+    if (s->passive)
+    {
+        deleteSocket(s);
+    }
 }
 
-void restartTcpStateMachine(void)
+// Starts an active open
+// A socket still in TIME_WAIT may reconnect right away since it gets a new port
+void sendTcpArpRequest(socket *s)
 {
-    synNeeded = false;
-    ackNeeded = false;
-    arpNeeded = false;
-    finNeeded = false;
-    setTcpState(0, TCP_CLOSED);
+    if (getTcpState(s) == TCP_TIME_WAIT)
+    {
+        restartTcpStateMachine(s);
+    }
+    s->arpNeeded = true;
 }
 
-void callbackNotEstablished(void)
+// Handshake timeouts back off exponentially, 1, 2, 4, 8 and 16 seconds
+void startTcpHandshakeTimer(socket *s)
 {
-    restartTcpStateMachine();
+    s->timer = TCP_SYN_TIMEOUT_S << s->retries;
+}
+
+void processTcpTimeout(socket *s)
+{
+    switch (getTcpState(s))
+    {
+        // No ARP response, SYN-ACK or handshake ACK
+        case TCP_CLOSED:
+        case TCP_SYN_SENT:
+        case TCP_SYN_RECEIVED:
+            if (s->retries >= TCP_SYN_RETRIES)
+            {
+                closeTcpSocket(s);
+                break;
+            }
+            s->retries++;
+            if (getTcpState(s) == TCP_CLOSED)
+            {
+                s->arpNeeded = true;
+            }
+            else
+            {
+                s->synNeeded = true;
+            }
+            break;
+        // Retransmission timeout, back off and resend the oldest segment
+        case TCP_ESTABLISHED:
+        case TCP_FIN_WAIT_1:
+        case TCP_CLOSING:
+        case TCP_CLOSE_WAIT:
+        case TCP_LAST_ACK:
+            // Window probes back off like retransmissions but are not retries, a peer
+            // may keep its window closed for as long as it likes
+            if (s->persisting)
+            {
+                s->probeNeeded = true;
+                if (s->rto < TCP_RTO_MAX_S)
+                {
+                    s->rto *= 2;
+                }
+                s->timer = s->rto;
+                break;
+            }
+            if (s->retries >= TCP_RETRIES)
+            {
+                closeTcpSocket(s);
+                break;
+            }
+            s->retries++;
+            if (s->rto < TCP_RTO_MAX_S)
+            {
+                s->rto *= 2;
+            }
+            // Only the first timeout of a loss halves ssthresh, the window restarts from one segment
+            if (s->retries == 1)
+            {
+                reduceTcpSsthresh(s);
+            }
+            s->cwnd = TCP_LOSS_WINDOW * getTcpSendMss(s);
+            s->dupAcks = 0;
+            s->fastRecovery = false;
+            s->retransmitNeeded = false;
+            // Queued data goes out again from sendTcpQueuedSegments, a lone FIN from retransmitTcpSegment
+            if (getFirstTcpSegment(s) != NULL)
+            {
+                resendTcpSegments(s);
+            }
+            else
+            {
+                s->retransmitNeeded = true;
+            }
+            break;
+        case TCP_FIN_WAIT_2:
+            closeTcpSocket(s);
+            break;
+        // Closed was reported on entering TIME_WAIT
+        case TCP_TIME_WAIT:
+            restartTcpStateMachine(s);
+            if (s->passive)
+            {
+                deleteSocket(s);
+            }
+            break;
+    }
+}
+
+// Runs socket timers for every second counted since the last call
+void processTcpTimers(void)
+{
+    uint8_t i;
+    socket *s;
+
+    while (tcpTicksDone != tcpTicks)
+    {
+        tcpTicksDone++;
+        for (i = 0; i < MAX_SOCKETS; i++)
+        {
+            s = getSocket(i);
+            if (s != NULL && s->timer > 0)
+            {
+                s->timer--;
+                if (s->timer == 0)
+                {
+                    processTcpTimeout(s);
+                }
+            }
+        }
+    }
 }
 
 //similar to getOptions in DHCP. Getting ptr of TCP
@@ -96,6 +629,77 @@ tcpHeader* getTcpHeaderPtr(etherHeader *ether)
     return (tcpHeader*)((uint8_t*)ip + (ip->size * 4));
 }
 
+// Header length from the data offset field, includes any options
+uint8_t getTcpHeaderLength(etherHeader *ether)
+{
+    tcpHeader *tcp = getTcpHeaderPtr(ether);
+    return (ntohs(tcp->offsetFields) >> OFS_SHIFT) * 4;
+}
+
+// Similar to getDhcpOption. Returns pointer to option value or 0 if not present
+uint8_t* getTcpOption(etherHeader *ether, uint8_t option, uint8_t *length)
+{
+    tcpHeader *tcp = getTcpHeaderPtr(ether);
+    uint8_t *options = tcp->data;
+    uint8_t *end = (uint8_t*)tcp + getTcpHeaderLength(ether);
+
+    while (options < end && *options != TCP_OPTION_END)
+    {
+        if (*options == TCP_OPTION_NOP)
+        {
+            options++;
+            continue;
+        }
+        // Malformed option length, stop parsing
+        if ((options + 1) >= end || options[1] < 2)
+        {
+            break;
+        }
+        if (*options == option)
+        {
+            if (length != NULL)
+            {
+                *length = options[1] - 2;
+            }
+            return options + 2;
+        }
+        options += options[1];
+    }
+
+    return 0;
+}
+
+// Stores the MSS offered in a SYN, RFC 1122 default if no option was sent
+void updateTcpMss(etherHeader *ether, socket *s)
+{
+    uint8_t length;
+    uint8_t *mss = getTcpOption(ether, TCP_OPTION_MSS, &length);
+
+    s->mss = TCP_DEFAULT_MSS;
+    if (mss != 0 && length == 2)
+    {
+        s->mss = (mss[0] << 8) | mss[1];
+    }
+    // Never send more than fits in our own frame
+    if (s->mss > TCP_MSS || s->mss == 0)
+    {
+        s->mss = TCP_MSS;
+    }
+}
+
+// Number of payload bytes carried by the segment
+uint16_t getTcpDataLength(etherHeader *ether)
+{
+    ipHeader *ip = (ipHeader*)ether->data;
+    return ntohs(ip->length) - (ip->size * 4) - getTcpHeaderLength(ether);
+}
+
+// Gets pointer to TCP payload of frame
+uint8_t* getTcpData(etherHeader *ether)
+{
+    return (uint8_t*)getTcpHeaderPtr(ether) + getTcpHeaderLength(ether);
+}
+
 void updateTcpSeqAck(etherHeader *ether, socket *s)
 {
     tcpHeader *tcp = getTcpHeaderPtr(ether);
@@ -129,21 +733,18 @@ bool isTcp(etherHeader* ether)
     return false;
 }
 
-// TODO: isTcpSyn is now fixed, but may need further testing
 bool isTcpSyn(etherHeader *ether)
 {
     tcpHeader *tcp = getTcpHeaderPtr(ether);
     return ((tcp->offsetFields & htons(SYN)) == htons(SYN)) ? true : false;
 }
 
-// TODO: isTcpAck is now fixed, but may need further testing
 bool isTcpAck(etherHeader *ether)
 {
     tcpHeader *tcp = getTcpHeaderPtr(ether);
     return ((tcp->offsetFields & htons(ACK)) == htons(ACK)) ? true : false;
 }
 
-// TODO: isTcpAck is now fixed, but may need further testing
 bool isTcpFin(etherHeader *ether)
 {
     tcpHeader *tcp = getTcpHeaderPtr(ether);
@@ -156,52 +757,143 @@ bool isTcpRst(etherHeader *ether)
     return ((tcp->offsetFields & htons(RST)) == htons(RST)) ? true : false;
 }
 
-// TODO: finish sendTcpPendingMessages state machine
-void sendTcpPendingMessages(etherHeader *ether, socket *s)
+// Sends pending ARP, SYN, ACK and FIN messages for every open socket
+void sendTcpPendingMessages(etherHeader *ether)
 {
-    if (arpNeeded)
-    {
-        // TODO: Add timer functionality to initial arp request
-        uint8_t localIpAddress[4];
-        uint8_t ipGwAddress[4];
+    uint8_t i;
+    socket *s;
 
-        getIpAddress(localIpAddress);
-        getIpGatewayAddress(ipGwAddress);
-        
-        sendArpRequest(ether, localIpAddress, ipGwAddress);
-        arpNeeded = false;
+    processTcpTimers();
 
-        startOneshotTimer(callbackNotEstablished, 5);
-    }
-    if (synNeeded)
+    for (i = 0; i < MAX_SOCKETS; i++)
     {
-        sendTcpMessage(ether, s, SYN, 0, 0);
-        setTcpState(0, TCP_SYN_SENT);
-        synNeeded = false;
-    }
-    if (ackNeeded)
-    {
-        sendTcpMessage(ether, s, ACK, 0, 0);
-        ackNeeded = false;
+        s = getSocket(i);
+        if (s == NULL)
+        {
+            continue;
+        }
+        if (s->arpNeeded)
+        {
+            uint8_t localIpAddress[4];
+            uint8_t ipGwAddress[4];
+
+            // Peers off our subnet are reached through the gateway
+            getIpAddress(localIpAddress);
+            getIpGatewayAddress(ipGwAddress);
+
+            sendArpRequest(ether, localIpAddress, isIpLocal(s->remoteIpAddress) ? s->remoteIpAddress : ipGwAddress);
+            s->arpNeeded = false;
+
+            startTcpHandshakeTimer(s);
+        }
+        if (s->synNeeded)
+        {
+            if (getTcpState(s) == TCP_SYN_RECEIVED)
+            {
+                sendTcpMessage(ether, s, SYN | ACK, 0, 0);
+            }
+            else
+            {
+                // New connections get a random port and ISN, retransmissions keep them
+                // so a restarted broker never sees segments that match its old state
+                if (getTcpState(s) == TCP_CLOSED)
+                {
+                    s->localPort = TCP_EPHEMERAL_PORT_MIN + (random32() % TCP_EPHEMERAL_PORT_COUNT);
+                    s->sequenceNumber = random32();
+                }
+                sendTcpMessage(ether, s, SYN, 0, 0);
+                setTcpState(s, TCP_SYN_SENT);
+            }
+            s->synNeeded = false;
+
+            startTcpHandshakeTimer(s);
+        }
+        if (s->retransmitNeeded)
+        {
+            retransmitTcpSegment(ether, s);
+            s->retransmitNeeded = false;
+        }
+        if (s->probeNeeded)
+        {
+            sendTcpWindowProbe(ether, s);
+            s->probeNeeded = false;
+        }
+        // Data segments carry the ACK as well
+        if (sendTcpQueuedSegments(ether, s, NULL))
+        {
+            s->ackNeeded = false;
+        }
+        if (s->ackNeeded)
+        {
+            sendTcpMessage(ether, s, ACK, 0, 0);
+            s->ackNeeded = false;
+        }
+        // FIN goes out after the last queued byte
+        if (s->finNeeded && getLastTcpSegment(s) != NULL && !getLastTcpSegment(s)->sent)
+        {
+            continue;
+        }
+        // Our FIN takes up a sequence number and is retransmitted until acknowledged
+        if (s->finNeeded)
+        {
+            if (getTcpState(s) == TCP_ESTABLISHED || getTcpState(s) == TCP_CLOSE_WAIT)
+            {
+                sendTcpMessage(ether, s, FIN | ACK, 0, 0);
+                s->sequenceNumber++;
+                startTcpRetransmitTimer(s);
+                setTcpState(s, (getTcpState(s) == TCP_ESTABLISHED) ? TCP_FIN_WAIT_1 : TCP_LAST_ACK);
+            }
+            s->finNeeded = false;
+        }
     }
-    if (finNeeded)
+}
+
+// Takes in-order data and FIN, anything else gets our current ACK again
+// Returns true if the peer's FIN was taken
+bool receiveTcpData(etherHeader *ether, socket *s)
+{
+    tcpHeader *tcp = getTcpHeaderPtr(ether);
+    uint16_t dataLength = getTcpDataLength(ether);
+    bool fin = false;
+
+    if (dataLength > 0 || isTcpFin(ether))
     {
-        sendTcpMessage(ether, s, FIN | ACK, 0, 0);
-        finNeeded = false;
+        if (ntohl(tcp->sequenceNumber) == s->acknowledgementNumber)
+        {
+            s->acknowledgementNumber += dataLength;
+            s->receivedLength = dataLength;
+
+            if (isTcpFin(ether))
+            {
+                s->acknowledgementNumber++;
+                fin = true;
+            }
+        }
+        s->ackNeeded = true;
     }
+    return fin;
 }
 
-// TODO: finish processTcpResponse state machine
 void processTcpResponse(etherHeader *ether, socket *s)
 {
+    tcpHeader *tcp = getTcpHeaderPtr(ether);
+    uint16_t dataLength = getTcpDataLength(ether);
+    uint8_t oldState = getTcpState(s);
+    uint32_t acked = 0;
+
+    s->receivedLength = 0;
     if (isTcpRst(ether))
     {
-        setTcpState(0, TCP_CLOSED);
-        s->localPort += 1;
+        closeTcpSocket(s);
         return;
     }
+
+    if (isTcpAck(ether) && getTcpState(s) >= TCP_ESTABLISHED && getTcpState(s) != TCP_TIME_WAIT)
+    {
+        acked = processTcpAck(ether, s);
+    }
     
-    switch (getTcpState(0))
+    switch (getTcpState(s))
     {
         case TCP_CLOSED:
             break;
@@ -209,117 +901,348 @@ void processTcpResponse(etherHeader *ether, socket *s)
             if (isTcpAck(ether) && isTcpSyn(ether))
             {
                 updateTcpSeqAck(ether, s);
+                updateTcpMss(ether, s);
 
-                stopTimer(callbackNotEstablished);
-                setTcpState(0, TCP_ESTABLISHED);
+                s->timer = 0;
+                s->retries = 0;
+                initTcpSendState(s, ether);
+                setTcpState(s, TCP_ESTABLISHED);
                 enableRedLED();
                 
-                ackNeeded = true;
+                s->ackNeeded = true;
             }
             break;
-        case TCP_ESTABLISHED:
-            if (isTcpFin(ether))
+        case TCP_LISTEN:
+            if (isTcpSyn(ether) && !isTcpAck(ether))
             {
-                updateTcpSeqAck(ether, s);
+                getSocketInfoFromTcpPacket(ether, s);
+                updateTcpMss(ether, s);
+
+                s->acknowledgementNumber = ntohl(tcp->sequenceNumber) + 1;
+                s->sequenceNumber = random32();
 
-                ackNeeded = true;
-                setTcpState(0, TCP_CLOSE_WAIT);
+                s->synNeeded = true;
+                setTcpState(s, TCP_SYN_RECEIVED);
+            }
+            break;
+        case TCP_SYN_RECEIVED:
+            // Our SYN-ACK was lost, send it again
+            if (isTcpSyn(ether))
+            {
+                s->synNeeded = true;
+                break;
+            }
+            if (!isTcpAck(ether) || ntohl(tcp->acknowledgementNumber) != s->sequenceNumber + 1)
+            {
+                break;
+            }
+
+            // SYN takes up one sequence number
+            s->sequenceNumber++;
+            s->timer = 0;
+            s->retries = 0;
+            initTcpSendState(s, ether);
+            setTcpState(s, TCP_ESTABLISHED);
+
+            // Handshake ACK may already carry data
+            if (dataLength == 0 && !isTcpFin(ether))
+            {
+                break;
+            }
+            // fall through
+        case TCP_ESTABLISHED:
+            if (receiveTcpData(ether, s))
+            {
+                setTcpState(s, TCP_CLOSE_WAIT);
             }
 
             // Not waiting
-            if (getTcpState(0) != TCP_CLOSE_WAIT)
+            if (getTcpState(s) != TCP_CLOSE_WAIT)
             {
                 break;
             }
+            // fall through
         case TCP_CLOSE_WAIT:
-            updateTcpSeqAck(ether, s);
-
-            finNeeded = true;
-            setTcpState(0, TCP_LAST_ACK);
+            // Moves to LAST_ACK once the FIN is out
+            s->finNeeded = true;
             break;
+        // Our FIN is acknowledged once the peer's ACK reaches sequenceNumber
         case TCP_FIN_WAIT_1:
-            if (isTcpAck(ether))
+            if (receiveTcpData(ether, s))
             {
-                setTcpState(0, TCP_FIN_WAIT_2);
+                if (s->sendUnacked == s->sequenceNumber)
+                {
+                    setTcpState(s, TCP_TIME_WAIT);
+                    s->timer = TCP_TIME_WAIT_S;
+                }
+                else
+                {
+                    setTcpState(s, TCP_CLOSING);
+                }
             }
-            if (isTcpFin(ether))
+            else if (s->sendUnacked == s->sequenceNumber)
             {
-                ackNeeded = true;
-                setTcpState(0, TCP_CLOSING);
+                // A peer that never sends its FIN is given up on after the same time
+                setTcpState(s, TCP_FIN_WAIT_2);
+                s->timer = TCP_TIME_WAIT_S;
             }
             break;
         case TCP_FIN_WAIT_2:
-            if (isTcpFin(ether))
+            if (receiveTcpData(ether, s))
             {
-                ackNeeded = true;
-                setTcpState(0, TCP_TIME_WAIT);
-                // Start time-wait timer
+                setTcpState(s, TCP_TIME_WAIT);
+                s->timer = TCP_TIME_WAIT_S;
             }
             break;
         case TCP_CLOSING:
-            if (isTcpAck(ether))
+            if (s->sendUnacked == s->sequenceNumber)
             {
-                setTcpState(0, TCP_TIME_WAIT);
-                // Start time-wait timer
+                setTcpState(s, TCP_TIME_WAIT);
+                s->timer = TCP_TIME_WAIT_S;
             }
             break;
         case TCP_TIME_WAIT:
-            // Closed by timer
+            // Closed by timer, a retransmitted FIN means our last ACK was lost
+            if (isTcpFin(ether))
+            {
+                s->ackNeeded = true;
+                s->timer = TCP_TIME_WAIT_S;
+            }
             break;
         case TCP_LAST_ACK:
-            if (isTcpAck(ether))
+            if (s->sendUnacked == s->sequenceNumber)
             {
                 disableRedLED();
-                setTcpState(0, TCP_CLOSED);
-                s->localPort += 1;
+                closeTcpSocket(s);
             }
             break;
     }
+
+    // Events run last since handlers may build messages in this frame
+    // Received data is read from the frame, so it goes before connected and acked
+    if (s->callbacks != NULL && getTcpState(s) != TCP_CLOSED)
+    {
+        if (s->receivedLength > 0 && s->callbacks->received != NULL)
+        {
+            s->callbacks->received(ether, s, getTcpData(ether), s->receivedLength);
+        }
+        if (oldState < TCP_ESTABLISHED && getTcpState(s) >= TCP_ESTABLISHED && s->callbacks->connected != NULL)
+        {
+            s->callbacks->connected(ether, s);
+        }
+        if (acked > 0 && s->callbacks->acked != NULL)
+        {
+            s->callbacks->acked(ether, s, acked);
+        }
+        // TIME_WAIT only lingers to ACK a retransmitted FIN, the application is done with it
+        if (oldState != TCP_TIME_WAIT && getTcpState(s) == TCP_TIME_WAIT && s->callbacks->closed != NULL)
+        {
+            s->callbacks->closed(s);
+        }
+    }
 }
 
-// TODO: Make sure processTcpArp works correctly
-// This is where we will get the hardware address
+// Handles a segment for a listening port that has no connection yet
+// A SYN takes a socket from the pool, anything else is reset
+void processTcpListenResponse(etherHeader *ether)
+{
+    socket *s;
+    socket reply = {0};
+    uint8_t port = getTcpPortIndex(ether);
+
+    if (port < MAX_TCP_PORTS && isTcpSyn(ether) && !isTcpAck(ether) && !isTcpRst(ether))
+    {
+        s = newSocket();
+        if (s != NULL)
+        {
+            s->passive = true;
+            setSocketCallbacks(s, tcpPortCallbacks[port], tcpPortContexts[port]);
+            setTcpState(s, TCP_LISTEN);
+            processTcpResponse(ether, s);
+            return;
+        }
+    }
+
+    sendTcpResponse(ether, &reply, RST | ACK);
+}
+
+// Takes the peer's hardware address from the reply to our ARP request
 void processTcpArpResponse(etherHeader *ether, socket *s)
 {
-    if (getTcpState(0) == TCP_CLOSED)
+    arpPacket *arp = (arpPacket*)ether->data;
+    uint8_t ipGwAddress[4];
+    uint8_t i;
+
+    // Only the reply from the host we asked, the peer itself or the gateway for peers off our subnet
+    getIpGatewayAddress(ipGwAddress);
+    if (memcmp(arp->sourceIp, isIpLocal(s->remoteIpAddress) ? s->remoteIpAddress : ipGwAddress, IP_ADD_LENGTH) != 0)
     {
-        arpPacket *arp = (arpPacket*)ether->data;
-        uint8_t i;
+        return;
+    }
 
+    // Only while waiting on our ARP request
+    if (getTcpState(s) == TCP_CLOSED && s->timer > 0)
+    {
         for (i = 0; i < HW_ADD_LENGTH; i++)
         {
             s->remoteHwAddress[i] = arp->sourceAddress[i];
         }
         
-        synNeeded = true;  
+        s->synNeeded = true;  
     }
 }
 
-// TODO: write setTcpPortList function
+// Sets the ports that accept connections (passive open)
 void setTcpPortList(uint16_t ports[], uint8_t count)
 {
+    uint8_t i;
+
+    if (count > MAX_TCP_PORTS)
+    {
+        count = MAX_TCP_PORTS;
+    }
+    for (i = 0; i < count; i++)
+    {
+        tcpPorts[i] = ports[i];
+        tcpPortCallbacks[i] = NULL;
+        tcpPortContexts[i] = NULL;
+    }
+    tcpPortCount = count;
+}
+
+// Opens one more listening port, the others stay as they are
+// Returns false if the list is full
+bool addTcpPort(uint16_t port, const socketCallbacks *callbacks, void *context)
+{
+    uint8_t i;
+
+    for (i = 0; i < tcpPortCount && tcpPorts[i] != port; i++);
+    if (i == MAX_TCP_PORTS)
+    {
+        return false;
+    }
+    tcpPorts[i] = port;
+    tcpPortCallbacks[i] = callbacks;
+    tcpPortContexts[i] = context;
+    if (i == tcpPortCount)
+    {
+        tcpPortCount++;
+    }
+    return true;
+}
+
+// Closes one listening port, connections already open run until the peer closes them
+void removeTcpPort(uint16_t port)
+{
+    uint8_t i;
+
+    for (i = 0; i < tcpPortCount; i++)
+    {
+        if (tcpPorts[i] == port)
+        {
+            tcpPortCount--;
+            tcpPorts[i] = tcpPorts[tcpPortCount];
+            tcpPortCallbacks[i] = tcpPortCallbacks[tcpPortCount];
+            tcpPortContexts[i] = tcpPortContexts[tcpPortCount];
+            return;
+        }
+    }
+}
+
+// Sets the callbacks and context given to connections accepted on a listening port
+void setTcpPortCallbacks(uint16_t port, const socketCallbacks *callbacks, void *context)
+{
+    uint8_t i;
+
+    for (i = 0; i < tcpPortCount; i++)
+    {
+        if (tcpPorts[i] == port)
+        {
+            tcpPortCallbacks[i] = callbacks;
+            tcpPortContexts[i] = context;
+        }
+    }
+}
+
+// Index in the port list of the segment's destination port, MAX_TCP_PORTS if not listening
+uint8_t getTcpPortIndex(etherHeader *ether)
+{
+    tcpHeader *tcp = getTcpHeaderPtr(ether);
+    uint16_t port = ntohs(tcp->destPort);
+    uint8_t i;
+
+    for (i = 0; i < tcpPortCount; i++)
+    {
+        if (tcpPorts[i] == port)
+        {
+            return i;
+        }
+    }
+    return MAX_TCP_PORTS;
 }
 
-// TODO: write isTcpPortOpen function
+// Determines whether the segment is for one of our listening ports
 bool isTcpPortOpen(etherHeader *ether)
 {
-    return false;
+    return getTcpPortIndex(ether) < MAX_TCP_PORTS;
 }
 
-// TODO: write sendTcpResponse function
+// Replies to the received segment without a connection, e.g. RST to a closed port
+// The socket is filled in from the segment
 void sendTcpResponse(etherHeader *ether, socket* s, uint16_t flags)
 {
+    tcpHeader *tcp = getTcpHeaderPtr(ether);
+    uint32_t segmentLength = getTcpDataLength(ether);
+
+    // Never answer a reset
+    if (isTcpRst(ether))
+    {
+        return;
+    }
+
+    getSocketInfoFromTcpPacket(ether, s);
+    s->mss = TCP_MSS;
+
+    // SYN and FIN each take up one sequence number
+    if (isTcpSyn(ether))
+    {
+        segmentLength++;
+    }
+    if (isTcpFin(ether))
+    {
+        segmentLength++;
+    }
+
+    // RFC 793: a reset takes its sequence number from the ACK field when there is one
+    if (isTcpAck(ether))
+    {
+        s->sequenceNumber = ntohl(tcp->acknowledgementNumber);
+        if (flags & RST)
+        {
+            flags &= ~ACK;
+        }
+    }
+    else
+    {
+        s->sequenceNumber = 0;
+    }
+    s->acknowledgementNumber = ntohl(tcp->sequenceNumber) + segmentLength;
+
+    sendTcpMessage(ether, s, flags, 0, 0);
 }
 
-// Send TCP message
-void sendTcpMessage(etherHeader *ether, socket *s, uint16_t flags, uint8_t data[], uint16_t dataSize)
+// Send a single TCP segment with the given sequence number, dataSize must fit within the peer MSS
+void sendTcpSegmentAt(etherHeader *ether, socket *s, uint32_t sequenceNumber, uint16_t flags, uint8_t data[], uint16_t dataSize)
 {
     uint8_t localHwAddress[6];
     uint8_t localIpAddress[4];
     uint8_t i = 0;
+    uint16_t j;
     uint32_t sum;
     uint16_t tmp16;
     uint16_t tcpLength = 0;
+    uint8_t tcpHeaderLength = sizeof(tcpHeader);
+    uint8_t *copyData;
 
     // Ether frame
     getEtherMacAddress(localHwAddress);
@@ -360,28 +1283,39 @@ void sendTcpMessage(etherHeader *ether, socket *s, uint16_t flags, uint8_t data[
     tcp->destPort = htons(s->remotePort);
 
     // Seq/Ack nums
-    tcp->sequenceNumber = htonl(s->sequenceNumber);
+    tcp->sequenceNumber = htonl(sequenceNumber);
     tcp->acknowledgementNumber = htonl(s->acknowledgementNumber);
 
+    // SYN and SYN-ACK advertise our MSS so the peer never needs to fragment
+    if (flags & SYN)
+    {
+        tcp->data[0] = TCP_OPTION_MSS;
+        tcp->data[1] = TCP_OPTION_MSS_LENGTH;
+        tcp->data[2] = HIBYTE(TCP_MSS);
+        tcp->data[3] = LOBYTE(TCP_MSS);
+        tcpHeaderLength += TCP_OPTION_MSS_LENGTH;
+    }
+
     // Sets data option and flag bits
-    tcp->offsetFields = htons(((sizeof(tcpHeader) / 4) << OFS_SHIFT) | flags);
+    tcp->offsetFields = htons(((tcpHeaderLength / 4) << OFS_SHIFT) | flags);
 
-    tcp->windowSize = htons(1500); //how far back I can look to give you stuff that is missing. Small window due to constrains in the redboard.
-    // changed it to 1500 based on Dr. Losh comments during lecture -r
+    // Receive window is one frame since packets are processed one at a time
+    tcp->windowSize = htons(TCP_WINDOW_SIZE);
 
     tcp->urgentPointer = htons(0);
 
-    // Copy passed in data into tcp struct
-    for (i = 0; i < dataSize; i++)
+    // Copy passed in data into tcp struct, unless it was written in place
+    copyData = (uint8_t*)tcp + tcpHeaderLength;
+    if (copyData != data)
     {
-        tcp->data[i] = data[i];
+        for (j = 0; j < dataSize; j++)
+        {
+            copyData[j] = data[j];
+        }
     }
 
-    // Increment seq num by data size
-    s->sequenceNumber += dataSize;
-
     // adjust lengths
-    tcpLength = sizeof(tcpHeader) + dataSize;
+    tcpLength = tcpHeaderLength + dataSize;
     ip->length = htons(ipHeaderLength + tcpLength);
 
     // 32-bit sum over ip header
@@ -403,3 +1337,186 @@ void sendTcpMessage(etherHeader *ether, socket *s, uint16_t flags, uint8_t data[
     // send packet
     putEtherPacket(ether, sizeof(etherHeader) + ipHeaderLength + tcpLength);
 }
+
+// Send the next TCP segment and advance the sequence number by its size
+void sendTcpSegment(etherHeader *ether, socket *s, uint16_t flags, uint8_t data[], uint16_t dataSize)
+{
+    sendTcpSegmentAt(ether, s, s->sequenceNumber, flags, data, dataSize);
+
+    // Increment seq num by data size
+    s->sequenceNumber += dataSize;
+}
+
+// Sends a queued segment, its bytes are copied back into the frame unless they are still there
+void transmitTcpSegment(etherHeader *ether, socket *s, tcpSegment *seg, bool inFrame)
+{
+    uint8_t *data = reserveTcpMessage(ether, s, NULL);
+
+    if (!inFrame)
+    {
+        memcpy(data, &tcpTxBuffer[seg->offset], seg->length);
+    }
+    sendTcpSegmentAt(ether, s, seg->sequenceNumber, PSH | ACK, data, seg->length);
+    seg->sent = true;
+    if (SEQ_GT(seg->sequenceNumber + seg->length, s->sequenceNumber))
+    {
+        s->sequenceNumber = seg->sequenceNumber + seg->length;
+    }
+}
+
+// Resends the oldest unacknowledged segment of a socket from the queue
+void retransmitTcpSegment(etherHeader *ether, socket *s)
+{
+    tcpSegment *seg = getFirstTcpSegment(s);
+
+    if (seg != NULL)
+    {
+        transmitTcpSegment(ether, s, seg, false);
+    }
+    // Only the FIN is left unacknowledged
+    else if (isTcpFinSent(s) && s->sendUnacked != s->sequenceNumber)
+    {
+        sendTcpSegmentAt(ether, s, s->sequenceNumber - 1, FIN | ACK, NULL, 0);
+    }
+    else
+    {
+        return;
+    }
+    s->timer = s->rto;
+}
+
+// Waits for a zero window to open, the timer sends a probe on each timeout
+void startTcpPersistTimer(socket *s)
+{
+    if (!s->persisting)
+    {
+        s->persisting = true;
+        s->timer = s->rto;
+    }
+}
+
+// Sends the next unsent byte alone, the peer drops it while its window is closed and
+// answers with its current window
+// The probe does not advance sequenceNumber, the whole segment goes out once the window opens
+void sendTcpWindowProbe(etherHeader *ether, socket *s)
+{
+    uint8_t i;
+    tcpSegment *seg;
+    uint8_t *data = reserveTcpMessage(ether, s, NULL);
+
+    for (i = 0; i < tcpSegmentCount; i++)
+    {
+        seg = &tcpSegments[(tcpSegmentHead + i) % TCP_TX_SEGMENTS];
+        if (seg->inUse && seg->s == s && !seg->sent)
+        {
+            data[0] = tcpTxBuffer[seg->offset];
+            sendTcpSegmentAt(ether, s, seg->sequenceNumber, ACK, data, 1);
+            return;
+        }
+    }
+}
+
+// Sends queued segments while the congestion and receive windows have room
+// With nothing in flight one segment always goes out, so a small window cannot stall us,
+// except into a zero window where only the persist timer's probes go
+// inFrame is a segment whose bytes are still in the frame, it goes out without a copy if
+// it is the first one sent
+// Returns true if anything was sent
+bool sendTcpQueuedSegments(etherHeader *ether, socket *s, tcpSegment *inFrame)
+{
+    uint8_t i;
+    tcpSegment *seg;
+    uint32_t window;
+    bool sent = false;
+
+    if (getTcpState(s) < TCP_ESTABLISHED || getTcpState(s) == TCP_TIME_WAIT)
+    {
+        return false;
+    }
+
+    window = (s->cwnd < s->remoteWindow) ? s->cwnd : s->remoteWindow;
+    for (i = 0; i < tcpSegmentCount; i++)
+    {
+        seg = &tcpSegments[(tcpSegmentHead + i) % TCP_TX_SEGMENTS];
+        if (!seg->inUse || seg->s != s || seg->sent)
+        {
+            continue;
+        }
+        if (s->remoteWindow == 0)
+        {
+            if (getTcpFlightSize(s) == 0)
+            {
+                startTcpPersistTimer(s);
+            }
+            break;
+        }
+        if (getTcpFlightSize(s) > 0 && getTcpFlightSize(s) + seg->length > window)
+        {
+            break;
+        }
+        transmitTcpSegment(ether, s, seg, seg == inFrame && !sent);
+        startTcpRetransmitTimer(s);
+        sent = true;
+    }
+    return sent;
+}
+
+// Send TCP message
+// Data is queued for retransmission and sent as MSS sized segments as far as the
+// congestion window allows, the rest follows from sendTcpPendingMessages as ACKs arrive.
+// One segment written in place at reserveTcpMessage is sent straight from the frame.
+// Returns false if the queue has no room for it
+bool sendTcpMessage(etherHeader *ether, socket *s, uint16_t flags, uint8_t data[], uint16_t dataSize)
+{
+    tcpSegment *inFrame = NULL;
+
+    if (dataSize > 0)
+    {
+        // Nothing may follow our FIN
+        if (isTcpFinSent(s) || !queueTcpData(s, data, dataSize))
+        {
+            return false;
+        }
+        if (data == reserveTcpMessage(ether, s, NULL) && dataSize <= getTcpSendMss(s))
+        {
+            inFrame = getLastTcpSegment(s);
+        }
+        sendTcpQueuedSegments(ether, s, inFrame);
+        return true;
+    }
+
+    sendTcpSegment(ether, s, flags, data, 0);
+    return true;
+}
+
+// Zero-copy send, step 1
+// Returns where the payload goes in the outbound frame, so the caller can build the
+// message in place instead of in its own buffer. maxSize is what one segment to this
+// peer holds.
+uint8_t* reserveTcpMessage(etherHeader *ether, socket *s, uint16_t *maxSize)
+{
+    ipHeader *ip = (ipHeader*)ether->data;
+
+    if (maxSize != NULL)
+    {
+        *maxSize = getTcpSendMss(s);
+    }
+    return (uint8_t*)ip + sizeof(ipHeader) + sizeof(tcpHeader);
+}
+
+// Zero-copy send, step 2
+// Sends the payload written after reserveTcpMessage from the frame and keeps a copy for
+// retransmission
+// Returns false if it overran the reservation or the retransmission queue has no room,
+// nothing is sent then
+bool commitTcpMessage(etherHeader *ether, socket *s, uint16_t flags, uint16_t dataSize)
+{
+    uint16_t maxSize;
+    uint8_t *data = reserveTcpMessage(ether, s, &maxSize);
+
+    if (dataSize > maxSize)
+    {
+        return false;
+    }
+    return sendTcpMessage(ether, s, flags, data, dataSize);
+}
@@ -64,16 +64,70 @@ typedef struct _tcpHeader
 #define NS  0x0100
 #define OFS_SHIFT 12
 
+// TCP options
+#define TCP_OPTION_END 0
+#define TCP_OPTION_NOP 1
+#define TCP_OPTION_MSS 2
+#define TCP_OPTION_MSS_LENGTH 4
+
+// Segment sizing
+// The ENC28J60 frame is capped at 1518 bytes (14 header + 1500 MTU + 4 CRC) and we
+// receive into a single frame buffer, so we offer one MTU of payload and no more
+#define TCP_MTU 1500
+#define TCP_MSS (TCP_MTU - 20 - 20) // IP and TCP headers without options
+#define TCP_DEFAULT_MSS 536         // RFC 1122 default when the peer sends no MSS
+#define TCP_WINDOW_SIZE TCP_MSS
+
+// Retransmission
+// Sent data is kept until acknowledged, segments share one ring of bytes and
+// are released oldest first. Timer ticks are 1 s so the RTO starts at 2 s to
+// guarantee at least one full second.
+#define TCP_TX_BUFFER_SIZE 2048
+#define TCP_TX_SEGMENTS 16
+#define TCP_RTO_S 2
+#define TCP_RTO_MAX_S 64
+#define TCP_RETRIES 6
+#define TCP_DUP_ACK_THRESHOLD 3
+
+// Congestion control (RFC 5681)
+// The initial and loss windows are counted in segments of the peer MSS
+#define TCP_INITIAL_WINDOW 2
+#define TCP_LOSS_WINDOW 1
+#define TCP_MIN_SSTHRESH 2
+
+typedef struct _tcpSegment
+{
+    socket *s;
+    uint32_t sequenceNumber;
+    uint16_t offset;                // Start of data in the ring
+    uint16_t length;
+    bool inUse;
+    bool sent;                      // Waits in the queue until the window allows it
+} tcpSegment;
+
+// Connection setup and teardown timers
+#define TCP_SYN_TIMEOUT_S 1             // Doubles on each retransmission of ARP, SYN or SYN-ACK
+#define TCP_SYN_RETRIES 5
+#define TCP_TIME_WAIT_S 30
+#define TCP_EPHEMERAL_PORT_MIN 49152    // IANA dynamic port range
+#define TCP_EPHEMERAL_PORT_COUNT 16384
+
 //-----------------------------------------------------------------------------
 // Subroutines
 //-----------------------------------------------------------------------------
 
-void sendAck(void);
-void sendTcpFin(void);
-void sendTcpArpRequest(void);
-void setTcpState(uint8_t instance, uint8_t state);
-uint8_t getTcpState(uint8_t instance);
+void callbackTcpTimer(void);
+void sendAck(socket *s);
+void sendTcpFin(socket *s);
+void sendTcpArpRequest(socket *s);
+void setTcpState(socket *s, uint8_t state);
+uint8_t getTcpState(socket *s);
+void closeTcpSocket(socket *s);
 tcpHeader* getTcpHeaderPtr(etherHeader *ether);
+uint8_t getTcpHeaderLength(etherHeader *ether);
+uint8_t* getTcpOption(etherHeader *ether, uint8_t option, uint8_t *length);
+uint16_t getTcpDataLength(etherHeader *ether);
+uint8_t* getTcpData(etherHeader *ether);
 void updateTcpSeqAck(etherHeader *ether, socket *s);
 
 bool isTcp(etherHeader *ether);
@@ -81,15 +135,25 @@ bool isTcpSyn(etherHeader *ether);
 bool isTcpAck(etherHeader *ether);
 bool isTcpFin(etherHeader *ether);
 
-void sendTcpPendingMessages(etherHeader *ether, socket *s);
+void sendTcpPendingMessages(etherHeader *ether);
 void processDhcpResponse(etherHeader *ether);
 void processTcpResponse(etherHeader *ether, socket *s);
+void processTcpListenResponse(etherHeader *ether);
 void processTcpArpResponse(etherHeader *ether, socket *s);
 
 void setTcpPortList(uint16_t ports[], uint8_t count);
+bool addTcpPort(uint16_t port, const socketCallbacks *callbacks, void *context);
+void removeTcpPort(uint16_t port);
+void setTcpPortCallbacks(uint16_t port, const socketCallbacks *callbacks, void *context);
+uint8_t getTcpPortIndex(etherHeader *ether);
 bool isTcpPortOpen(etherHeader *ether);
 void sendTcpResponse(etherHeader *ether, socket* s, uint16_t flags);
-void sendTcpMessage(etherHeader *ether, socket* s, uint16_t flags, uint8_t data[], uint16_t dataSize);
+bool sendTcpMessage(etherHeader *ether, socket* s, uint16_t flags, uint8_t data[], uint16_t dataSize);
+uint8_t* reserveTcpMessage(etherHeader *ether, socket *s, uint16_t *maxSize);
+bool commitTcpMessage(etherHeader *ether, socket *s, uint16_t flags, uint16_t dataSize);
+void retransmitTcpSegment(etherHeader *ether, socket *s);
+void sendTcpWindowProbe(etherHeader *ether, socket *s);
+bool sendTcpQueuedSegments(etherHeader *ether, socket *s, tcpSegment *inFrame);
 
 #endif
 
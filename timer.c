@@ -35,7 +35,11 @@ _callback fn[NUM_TIMERS];
 uint32_t period[NUM_TIMERS];
 uint32_t ticks[NUM_TIMERS];
 bool reload[NUM_TIMERS];
+uint32_t uptime = 0;
 char str[40];
+
+// xoshiro128** state, never all zero
+uint32_t randomState[4] = {0x6C078965, 0x9908B0DF, 0x3A5D1F27, 0xB5026F5A};
 //-----------------------------------------------------------------------------
 // Subroutines
 //-----------------------------------------------------------------------------
@@ -134,6 +138,7 @@ bool restartTimer(_callback callback)
 void tickIsr()
 {
     uint8_t i;
+    uptime++;
     for (i = 0; i < NUM_TIMERS; i++)
     {
         if (ticks[i] != 0)
@@ -193,6 +198,12 @@ void Kill_AllTimers()
 
 }
 
+// Seconds since initTimer
+uint32_t getUptime()
+{
+    return uptime;
+}
+
 uint8_t countTimers()
 {
     uint8_t i = 0;
@@ -210,9 +221,46 @@ uint8_t countTimers()
 }
 
 
-// Placeholder random number function
+uint32_t rotateLeft32(uint32_t x, uint8_t k)
+{
+    return (x << k) | (x >> (32 - k));
+}
+
+// Mixes entropy into the random number generator, may be called any number of times
+// The current timer count is mixed in as well, so the arrival time of the call counts
+void seedRandom32(uint32_t seed)
+{
+    uint8_t i;
+    uint32_t z;
+
+    seed ^= TIMER4_TAV_R;
+    for (i = 0; i < 4; i++)
+    {
+        // splitmix32 scramble so similar seeds give unrelated states
+        seed += 0x9E3779B9;
+        z = seed;
+        z = (z ^ (z >> 16)) * 0x85EBCA6B;
+        z = (z ^ (z >> 13)) * 0xC2B2AE35;
+        z ^= z >> 16;
+        randomState[i] ^= z;
+    }
+    if ((randomState[0] | randomState[1] | randomState[2] | randomState[3]) == 0)
+        randomState[0] = 1;
+}
+
+// xoshiro128** pseudo-random number generator
 uint32_t random32()
 {
-    return TIMER4_TAV_R;
+    uint32_t result = rotateLeft32(randomState[1] * 5, 7) * 9;
+    uint32_t t = randomState[1] << 9;
+
+    randomState[2] ^= randomState[0];
+    randomState[3] ^= randomState[1];
+    randomState[1] ^= randomState[2];
+    randomState[0] ^= randomState[3];
+    randomState[2] ^= t;
+    randomState[3] = rotateLeft32(randomState[3], 11);
+
+    return result;
 }
 
@@ -33,8 +33,10 @@ bool restartTimer(_callback callback);
 void KillTimer(_callback callback);
 void Kill_AllTimers();
 uint8_t countTimers();
+uint32_t getUptime();
 
 void tickIsr();
+void seedRandom32(uint32_t seed);
 uint32_t random32();
 
 #endif